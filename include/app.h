@@ -2,16 +2,10 @@
 #define APP_H
 
 #include <nanogui/screen.h>
-#include "pipeline/pipeline.h"
 #include "pipeline/texture.h"
-#include "mesh.h"
+#include "scene.h"
 #include "param.h"
 
-#include "../shaders/octreebuilder.h"
-#include "../shaders/passthrough.h"
-#include "../shaders/raymarcher.h"
-#include "../shaders/AO.h"
-
 const int DEFAULT_WIDTH = 960;
 const int DEFAULT_HEIGHT = 540;
 
@@ -19,15 +13,15 @@ class Engine : public nanogui::Screen
 {
 private:
   // octree build up
-  VertexShader standard;
+  StandardShader standard;
   OctreeBuilderShader voxelizer;
-  GraphicPipeline gp;
+  VoxelizerPipeline gp;
   Framebuffer octreeTarget;
 
   // voxel rendering
-  GraphicPipeline renderer;
+  AOPipeline renderer;
 
-  VertexShader standard_renderer;
+  StandardShader standard_renderer;
   AmbientOcclusionShader amb_occ;
 
   PassthroughShader passthrough;
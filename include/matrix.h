@@ -94,11 +94,18 @@ public:
   float& operator()(int i, int j);
   float operator()(int i, int j) const;
   float* data() { return e; }
+  const float* data() const { return e; }
 
   //--------- Operators ---------
   mat4 operator*(const mat4& rhs) const;
   vec4 operator*(const vec4& rhs) const;
 
+  mat4 transpose() const;
+
+  // inverse by cofactor expansion. Singular matrices
+  // give a matrix of infinities/NaNs
+  mat4 inverse() const;
+
   //--------- Matrix constructors ---------
   static mat4 viewport(int width, int height)
   {
@@ -22,7 +22,12 @@ private:
                           const tinyobj::attrib_t& attrib);
 
 public:
+  // vertex data. Each vertex is a unique combination of
+  // position/normal/uv indices in the .obj file, so vertices
+  // shared by many faces appear only once; every 3 elements
+  // of indices make up a triangle.
   std::vector<float> pos, uv, normal;
+  std::vector<int> indices;
 
   Mesh() {}
   Mesh(const std::string& path)
@@ -0,0 +1,70 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <vector>
+#include <cstddef>
+
+struct ArenaStats
+{
+  size_t capacity;    // bytes currently reserved
+  size_t used;        // bytes allocated since the last reset()
+  size_t high_water;  // maximum of used over all frames
+  int grows;          // times we had to ask the system for memory
+};
+
+// Bump allocator for the transient buffers of a frame. Memory is
+// never returned to the system: reset() just rewinds the arena, so
+// after the first few frames allocating is just a pointer increment.
+// When a frame doesn't fit, a new block (at least as large as all
+// the others together) is added, and on the next reset() all the
+// blocks are merged into a single one. Allocations are aligned to
+// cache lines. This is not thread safe: allocate in the serial
+// parts of the pipeline and hand the memory to the threads.
+class ScratchArena
+{
+private:
+  struct Block
+  {
+    char *data;
+    size_t size, used;
+  };
+  std::vector<Block> blocks;
+
+  // the last allocation, which can be grown in place
+  void *last;
+  size_t last_sz;
+
+  size_t used, high_water;
+  int grows;
+
+  void add_block(size_t min_size);
+
+public:
+  static const size_t ALIGNMENT = 64;
+
+  ScratchArena();
+  ~ScratchArena();
+
+  // frees everything allocated since the last reset()
+  void reset();
+
+  void* allocate(size_t bytes);
+  template<typename T> T* allocate(int n)
+  {
+    return (T*)allocate(n * sizeof(T));
+  }
+
+  // grows the allocation p from old_n to new_n elements. If p is
+  // the last allocation and there is room for it, this happens in
+  // place; otherwise new memory is allocated and the first old_n
+  // elements are copied.
+  void* grow(void* p, size_t old_bytes, size_t new_bytes);
+  template<typename T> T* grow(T* p, int old_n, int new_n)
+  {
+    return (T*)grow((void*)p, old_n * sizeof(T), new_n * sizeof(T));
+  }
+
+  ArenaStats stats() const;
+};
+
+#endif
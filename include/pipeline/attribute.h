@@ -1,6 +1,41 @@
 #ifndef ATTRIBUTE_H
 #define ATTRIBUTE_H
 
+#include <string>
+#include <map>
+#include <vector>
+
 struct Attribute { int size; int stride; };
 
+// Attributes (and uniforms) are stored in a vector and addressed
+// by slot, an integer which never changes once the name is known
+// to the table. Name lookups go through the map and should happen
+// once, outside the hot paths; shaders resolve the slots they need
+// when they are bound to a pipeline and index the vector afterwards.
+// Asking for the slot of an unknown name reserves a new slot, so
+// shaders can be bound before the attributes/uniforms are defined.
+class AttributeTable
+{
+private:
+  std::map<std::string, int> ids;
+  std::vector<Attribute> slots;
+
+public:
+  int slot(const std::string& name)
+  {
+    auto it = ids.find(name);
+    if(it != ids.end()) return it->second;
+
+    Attribute undefined = {0, 0};
+    slots.push_back(undefined);
+    return ids[name] = (int)slots.size() - 1;
+  }
+
+  Attribute& operator[](int slot) { return slots[slot]; }
+  const Attribute& operator[](int slot) const { return slots[slot]; }
+
+  // compatibility with the old name-based access
+  Attribute& operator[](const std::string& name) { return slots[slot(name)]; }
+};
+
 #endif
@@ -11,6 +11,17 @@
 class FragmentShader
 {
 protected:
+  // see VertexShader for slot-based vs name-based access
+  inline const float* get_uniform(int slot)
+  {
+    return &uniform_data[(*uniforms)[slot].stride];
+  }
+
+  inline const float* get_attribute(int slot, const float* vbuffer)
+  {
+    return &vbuffer[4 + (*attribs)[slot].stride];
+  }
+
   inline const float* get_uniform(const std::string& name)
   {
     int stride = (*uniforms)[name].stride;
@@ -24,14 +35,39 @@ protected:
     return &vbuffer[4 + stride];
   }
 
+  inline int uniform_slot(const std::string& name) { return uniforms->slot(name); }
+  inline int attribute_slot(const std::string& name) { return attribs->slot(name); }
+
+  // see VertexShader::uniform_version()
+  inline unsigned int uniform_version(int slot) const
+  {
+    return slot < (int)uniform_versions->size() ? (*uniform_versions)[slot] : 0;
+  }
+
 public:
   virtual rgba launch(const float* vertex_in, const float* dVdx, int n);
 
+  // shades count fragments at once: fragment i starts at
+  // vertex_in[i*stride], its derivatives at dVdx[i*stride] and its
+  // color goes to out[i]. The pipeline always calls this one, so
+  // we pay a single virtual call per batch. By default it just calls
+  // launch() for each fragment; shaders should override it with a
+  // loop calling non-virtual code.
+  virtual void launch_batch(const float* vertex_in, const float* dVdx,
+                            int count, int stride, rgba* out);
+
+  // invoked by the pipeline once attribs/uniforms are set
+  virtual void resolve_slots() {}
+
+  // see VertexShader::prepare()
+  virtual void prepare() {}
+
   // uniform memory
   const float *uniform_data;
-  std::map<std::string, Attribute> *uniforms;
+  AttributeTable *uniforms;
+  const std::vector<unsigned int> *uniform_versions;
 
-  std::map<std::string, Attribute> *attribs;
+  AttributeTable *attribs;
   std::vector<TextureSampler> *tex_units;
 };
 
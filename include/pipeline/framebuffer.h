@@ -1,12 +1,11 @@
 #ifndef FRAMEBUFFER_H
 #define FRAMEBUFFER_H
 
-#include <nanogui/opengl.h>
-#include <nanogui/glutil.h>
-
+// no GL here: the framebuffer lives in main memory, and
+// it's up to the application to display it (or not)
 struct RGBA8
 {
-  GLubyte r, g, b, a;
+  unsigned char r, g, b, a;
 };
 
 class Framebuffer
@@ -16,6 +15,25 @@ private:
   RGBA8 *color;
   float *depth;
 
+  // hierarchical depth: a conservative (i.e., never smaller
+  // than the actual value) maximum depth for each HIZ_TILE²
+  // block of the depth buffer. When a write may have lowered
+  // the maximum of a tile we only mark it as dirty, and the
+  // actual maximum is recomputed next time it is queried.
+  int hiz_w, hiz_h;
+  float *hiz_max;
+  unsigned char *hiz_dirty;
+
+  // geometry buffer for deferred shading: gbuffer_elem_sz
+  // floats per pixel, valid only where gbuffer_covered is set.
+  // It is allocated only when some pipeline requests it.
+  int gbuffer_elem_sz;
+  float *gbuffer;
+  unsigned char *gbuffer_covered;
+
+  void allocate(int w, int h);
+  void release();
+
 public:
   Framebuffer();
   Framebuffer(int w, int h);
@@ -30,12 +48,35 @@ public:
   void setDepthBuffer(int i, int j, float depth);
   float getDepthBuffer(int i, int j) const;
 
+  // maximum depth inside the hierarchical depth tile (ti,tj),
+  // i.e., pixels [ti*HIZ_TILE, (ti+1)*HIZ_TILE) x [tj*HIZ_TILE, ...)
+  static const int HIZ_TILE = 8;
+  float tileMaxDepth(int ti, int tj);
+
+  // true if a primitive with minimum depth min_z covering only
+  // pixels inside rows [i0,i1] and columns [j0,j1] is guaranteed
+  // to fail the depth test in all of them. The test is < or, if
+  // pass_equal is set, <=.
+  bool occluded(int i0, int j0, int i1, int j1, float min_z,
+                bool pass_equal = false);
+
+  // depth is cleared to the far plane by default: every
+  // projection maps it to z = 1 (and the near one to z = -1)
   void clearColorBuffer();
-  void clearDepthBuffer();
+  void clearDepthBuffer(float value = 1.0f);
+
+  // G-buffer management. resizeGBuffer() only reallocates if the
+  // element size changes. gBufferWrite() returns the element of
+  // pixel (i,j) and marks it as covered; gBufferRead() returns
+  // NULL if nothing was written to (i,j) since the last clear.
+  void resizeGBuffer(int elem_sz);
+  void clearGBuffer();
+  float* gBufferWrite(int i, int j);
+  const float* gBufferRead(int i, int j) const;
 
-  GLubyte* colorBuffer()
+  unsigned char* colorBuffer()
   {
-    return reinterpret_cast<GLubyte*>(color);
+    return reinterpret_cast<unsigned char*>(color);
   }
 };
 
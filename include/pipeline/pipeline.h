@@ -4,16 +4,116 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <chrono>
 #include "../matrix.h"
 #include "framebuffer.h"
 #include "vertexshader.h"
 #include "fragmentshader.h"
 #include "attribute.h"
 #include "texsampler.h"
+#include "threadpool.h"
+#include "vertexbuffer.h"
+#include "arena.h"
+
+// triangle rasterization algorithms. SCANLINE walks the triangle
+// edges and fills horizontal spans; HALF_SPACE evaluates the three
+// edge functions over the triangle bounding box, 8 pixels at a time,
+// following the top-left fill rule (so pixels on shared edges are
+// drawn exactly once).
+enum RasterAlgorithm { RASTER_SCANLINE, RASTER_HALF_SPACE };
+
+// layout of the working vertex buffer (the output of vertex
+// processing). AOS stores whole elements [x y z w attrs... 1]
+// contiguously; SOA stores every component of the elements in
+// its own plane, so clipping tests, perspective division and
+// culling run over 8 vertices/triangles at a time (with AVX).
+// Shaders and rasterizers see whole elements either way.
+enum VertexStream { VERTEX_STREAM_AOS, VERTEX_STREAM_SOA };
+
+// depth test functions, as in glDepthFunc(): a fragment passes
+// if its depth compares this way to the one in the depth buffer
+enum DepthFunc { DEPTH_LESS, DEPTH_LEQUAL, DEPTH_GREATER,
+                 DEPTH_GEQUAL, DEPTH_EQUAL, DEPTH_ALWAYS };
+
+// wall clock time (in seconds) spent in each stage by the last
+// render() call, when profiling is enabled. Some of these are
+// done in the same pass (the vertex shader and the perspective
+// division, clipping and culling, rasterization and fragment
+// shading when not deferred), so the wall time of the pass is
+// split between them in proportion to the time threads spent
+// in each. Culling includes everything in primitive assembly
+// but clipping, and rasterization includes the depth test and
+// the G-buffer writes; fragment counts the fragment shader and
+// the color buffer writes.
+struct StageTimes
+{
+  double vertex, clip, divide, cull, raster, fragment;
+};
+
+// pipeline statistics, like the OpenGL query objects. Counting
+// is compiled out in release builds (when NDEBUG is defined),
+// unless PIPELINE_STATS is defined as 1; in that case render()
+// gives zero for everything.
+#ifndef PIPELINE_STATS
+#ifdef NDEBUG
+#define PIPELINE_STATS 0
+#else
+#define PIPELINE_STATS 1
+#endif
+#endif
+
+#if PIPELINE_STATS
+#define PIPELINE_STAT(counter, n) ((counter) += (n))
+#else
+#define PIPELINE_STAT(counter, n) ((void)0)
+#endif
+
+// counters for a single render() call. Triangles are counted
+// as they come from the index buffer: the ones sent to the
+// clipper (which may split them or discard them) are clipped;
+// culled ones were discarded without clipping, for lying outside
+// the view volume or facing away from the camera. Rasterized
+// triangles are the ones left after clipping and culling.
+// Fragments are generated by the rasterizers for every covered
+// pixel not rejected by the hierarchical depth test; the ones
+// surviving the depth test are shaded (in the G-buffer pass,
+// they are shaded later only if not overwritten). As shaders
+// can't discard fragments, every invocation writes a pixel.
+struct PipelineStats
+{
+  long long vertices_shaded;
+  long long triangles_clipped, triangles_culled, triangles_rasterized;
+  long long fragments_generated, fragments_depth_failed;
+  long long fragment_shader_invocations, pixels_written;
+};
+
+// Shading policy: how the pipeline stages invoke the shaders.
+// ELEM_SZ is the size of a vbuffer element, when known at compile
+// time (0 otherwise). This one goes through the virtual launch_batch()
+// of whatever shaders are bound; see SpecializedPipeline for the
+// statically dispatched one.
+struct VirtualShading
+{
+  static const int ELEM_SZ = 0;
+
+  static void shade_vertices(VertexShader* vs, const float* vertex_in,
+                              float* vertex_out, int count,
+                              int in_stride, int out_stride)
+  {
+    vs->launch_batch(vertex_in, vertex_out, count, in_stride, out_stride);
+  }
+
+  static void shade_fragments(FragmentShader* fs, const float* frags,
+                              const float* dVdx, int count, int stride,
+                              rgba* out)
+  {
+    fs->launch_batch(frags, dVdx, count, stride, out);
+  }
+};
 
 class GraphicPipeline
 {
-private:
+protected:
   // Array of attributes. In a first moment we'll work
   // with FLOAT attributes only because it is easier to
   // manage pointer and interpolation if all attributes
@@ -25,8 +125,12 @@ private:
   // change, as we might need it to perform subsequent
   // calls to the graphic pipeline to render the same
   // object without changing its data.
+  // The pipeline doesn't own this memory: it either belongs to
+  // the shared VertexBuffer in input or is borrowed from the
+  // caller, so uploading data never copies it.
   const float *vbuffer_in;
   int vbuffer_in_sz; //number of floats
+  VertexBufferRef input;
 
   // Vertex size. The DATA array is comprised of vertex
   // attributes all aligned; vertex_size defines how many
@@ -36,22 +140,47 @@ private:
   int vertex_size;
   int n_vertices;
 
+  // Index buffer. Every 3 indices (of vertices in vbuffer_in)
+  // make up a triangle, so vertices shared by many triangles
+  // are stored (and shaded) once. Triangle soups are uploaded
+  // with the trivial index buffer 0, 1, 2, ..., which is the
+  // only one we own (soup_indices)
+  const int *ibuffer_in;
+  int ibuffer_in_sz; //number of ints
+  std::vector<int> soup_indices;
+
   // this is the actual vertex buffer we'll be working in.
   // vbuffer_elem_sz defines the size of a single element
   // inside vbuffer (i.e., it includes the W parameter used
   // for interpolation and vertex position is stored as 4 floats).
   // All sizes here are expressed in NUMBER OF FLOATS, so
   // if each vertex has XYZW position only and we have 10 vertices,
-  // vbuffer_elem_sz = 4, tri_sz = 3*4 = 12 and vbuffer_sz = 10*12 = 120
+  // vbuffer_elem_sz = 4 and vbuffer_sz = 10*4 = 40.
+  // vbuffer works as a post-transform cache: its first n_vertices
+  // elements correspond to the vertices in vbuffer_in, which the
+  // vertex shader fills once, and triangles are assembled by index
+  // from it. Vertices created by clipping are appended after them,
+  // so vbuffer_sz changes every frame. Its memory comes from the
+  // arena and is only valid until the next render() call.
+  // In the SOA layout, component i of element e is stored at
+  // vbuffer[i*vbuffer_stride + e], where vbuffer_stride is the
+  // number of elements rounded up to a multiple of 8.
   float *vbuffer;
   int vbuffer_sz;
   int vbuffer_elem_sz;
-  int tri_sz;
+  VertexStream vertex_stream;
+  int vbuffer_stride;
+
+  // indices of the triangles which survived clipping and culling.
+  // Clipping may split triangles, so this may be larger than
+  // ibuffer_in. Also allocated from the arena.
+  int *ibuffer;
+  int ibuffer_sz;
 
   // Attributes can be accessed within the vbuffer_in
   // by knowing its size and stride. We store this info
   // so it can be accessed later by the shaders
-  std::map<std::string, Attribute> attribs;
+  AttributeTable attribs;
 
   // each texture unit is a texture sampler which can
   // receive a TEXTURE and some texture-related configuration
@@ -64,10 +193,20 @@ private:
   // area. OpenGL doesn't require one to set how many memory
   // will be needed to store uniforms, so we use a vector here
   // to reproduce this behaviour.
-  // If we know the total size of uniforms we'll need we
-  // can .reserve() this vector.
-  float *uniform_data; int uniform_data_index;
-  std::map<std::string, Attribute> uniforms;
+  // Every slot gets its place in uniform_data the first time
+  // it is uploaded and is updated in place afterwards, so
+  // uniforms keep their values between render() calls. As the
+  // vector may move when it grows, shaders are pointed to it
+  // again at the beginning of every render().
+  std::vector<float> uniform_data;
+  AttributeTable uniforms;
+
+  // uniform_versions[slot] is the value of uniform_clock when
+  // the uniform in slot last changed (uploading the same value
+  // again doesn't count). Shaders use it to know whether values
+  // derived from uniforms must be recomputed.
+  std::vector<unsigned int> uniform_versions;
+  unsigned int uniform_clock;
 
   /*
   mat4 model, view, projection, viewport;
@@ -90,12 +229,214 @@ private:
   VertexShader *vshader;
   FragmentShader *fshader;
 
-  // fixed stages
-  void vertex_processing();
-  int primitive_clipping();
-  void perspective_division();
-  int primitive_culling(bool cull_back);
+  // screen-space region [x0,x1) x [y0,y1) the rasterizer is
+  // allowed to write to. In single-threaded mode this is the
+  // whole render target; in tiled mode each tile is a Tile.
+  struct Tile { int x0, y0, x1, y1; };
+
+  // tiled rasterization. Triangles are binned into TILE_SIZE²
+  // screen tiles after culling and the tiles are rasterized in
+  // parallel, each one by a single thread, so threads never write
+  // the same pixel. See rasterization() for how bins are stored.
+  static const int TILE_SIZE = 32;
+  bool tiled;
+  ThreadPool pool;
+
+  RasterAlgorithm raster_algorithm;
+
+  // deferred shading. When enabled (and the z-buffer is on), the
+  // rasterizers only resolve visibility and store the surviving
+  // fragments in the render target G-buffer (gbuffer_pass is true
+  // while doing so); the fragment shader then runs exactly once per
+  // covered pixel in deferred_shading().
+  bool deferred;
+  bool gbuffer_pass;
+
+  // depth state, used when render() is called with the z-buffer
+  // enabled. Without it, the rasterizers are instantiated with no
+  // depth path at all (see fragment_operations).
+  DepthFunc depth_func;
+  bool depth_write;
+
+  bool depth_test(float z, float stored) const
+  {
+    switch(depth_func)
+    {
+      case DEPTH_LESS: return z < stored;
+      case DEPTH_LEQUAL: return z <= stored;
+      case DEPTH_GREATER: return z > stored;
+      case DEPTH_GEQUAL: return z >= stored;
+      case DEPTH_EQUAL: return z == stored;
+      default: return true;
+    }
+  }
+
+  // the hierarchical depth buffer keeps the maximum depth of
+  // each tile, which only lets us reject primitives for the
+  // functions failing on larger depths
+  bool hiz_usable() const
+  {
+    return depth_func == DEPTH_LESS || depth_func == DEPTH_LEQUAL ||
+            depth_func == DEPTH_EQUAL;
+  }
+
+  // per-thread rasterization state: the rasterization "registers"
+  // (see rasterize_scanline), allocated contiguously, and a batch of
+  // up to FRAGMENT_BATCH fragments waiting for the fragment shader.
+  // Fragments are queued once they pass the depth test, and the batch
+  // is flushed (shaded and written to the color buffer, in order)
+  // when full, so the fragment shader is invoked once per batch.
+  // The buffers point into the arena (see setup_raster_state).
+  static const int FRAGMENT_BATCH = 64;
+  struct RasterState
+  {
+    float *regs;
+
+    int n_frags;
+    float *frags, *dVdx;
+    int *frag_x, *frag_y;
+    rgba *colors;
+
+    // fragments shaded by this thread
+    int shaded;
+
+    // polygon being clipped, when this thread runs clip_triangle()
+    float *clip;
+
+    // output of the vertex shader in the SOA layout, which
+    // is then scattered to the vbuffer planes
+    float *vertices;
+
+    // when profiling: time this thread spent in the current
+    // parallel pass, and in the part of it we're measuring
+    double busy_time, sub_time;
+
+    // this thread's share of the statistics of the current
+    // frame, when counting is compiled in
+    PipelineStats stats;
+  };
+  std::vector<RasterState> raster_state;
+
+  // number of fragment shader invocations in the last render() call
+  int n_shaded;
+
+  // per stage timings of the last render() call. Timing
+  // is only done if profiling is enabled.
+  bool profiling;
+  StageTimes times;
+
+  static double clock_seconds()
+  {
+    return std::chrono::duration<double>(
+              std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // the part of a parallel pass which took wall seconds that
+  // corresponds to the measured sub-stage (see RasterState), and
+  // resets the thread clocks for the next pass
+  double sub_stage_time(double wall);
+
+  // vertices are handed to the vertex shader in batches
+  static const int VERTEX_BATCH = 64;
+
+  // vertex processing runs in parallel over chunks of vertices,
+  // and computes the clipping outcode of every vertex (see
+  // outcode() in pipelinestages.h), stored in vcodes.
+  static const int VERTEX_CHUNK = 4096;
+  unsigned char *vcodes;
+
+  // primitive assembly (clipping and culling) runs in parallel
+  // over chunks of triangles. Every chunk stores the indices of
+  // its surviving triangles and the vertices created by clipping,
+  // which get negative indices until primitive_assembly() moves
+  // them to ibuffer/vbuffer, at tri_offset and vert_offset. Chunks
+  // are kept between frames so their memory is reused (their size
+  // is only known by the thread filling them, so they can't come
+  // from the arena).
+  static const int TRIANGLE_CHUNK = 4096;
+  struct ClipChunk
+  {
+    std::vector<int> tris;
+    std::vector<float> verts;
+    int tri_offset, vert_offset;
+  };
+  std::vector<ClipChunk> clip_chunks;
+
+  // every buffer which lives for a single frame (vbuffer, ibuffer,
+  // vcodes, the tile bins and the per-thread state) is allocated
+  // from here. The arena is rewound at the beginning of render(),
+  // so once it is large enough for a frame nothing is allocated
+  // anymore.
+  ScratchArena arena;
+
+  // fixed stages. The ones invoking shaders are templates on
+  // the shading policy and are defined in pipelinestages.h
+  template<class Shading>
+  void run_pipeline(Framebuffer& target, bool zbuffer, bool culling,
+                    bool cull_back, bool fill, PipelineStats* stats);
+
+  template<class Shading> void vertex_processing();
+  int primitive_assembly(bool culling, bool cull_back);
+  void clip_triangle(const int* tri, int planes, bool culling,
+                      bool cull_back, RasterState& state, ClipChunk& out);
+  template<class Shading>
   void rasterization(Framebuffer& render_target, bool zbuffer, bool fill);
+  template<class Shading>
+  void deferred_shading(Framebuffer& render_target);
+
+  // vbuffer element size, as a constant when Shading knows it
+  template<class Shading> int elem_size() const
+  {
+    return Shading::ELEM_SZ ? Shading::ELEM_SZ : vbuffer_elem_sz;
+  }
+
+  // component i of vbuffer element e, whatever the layout
+  float vertex_component(int e, int i) const
+  {
+    return vertex_stream == VERTEX_STREAM_SOA ? vbuffer[i*vbuffer_stride + e]
+                                              : vbuffer[e*vbuffer_elem_sz + i];
+  }
+
+  // vbuffer element e. In the AOS layout this is just a pointer
+  // inside vbuffer; in the SOA one, it is gathered into tmp
+  template<class Shading> const float* fetch_vertex(int e, float* tmp) const;
+
+  // bit i is set if the i-th of the count (<= 8) triangles starting
+  // at tris is culled. Clip space triangles give meaningless bits.
+  unsigned int cull_mask(const int* tris, int count, bool cull_back) const;
+
+  // rasterize a single triangle (the indices of its vertices
+  // in vbuffer), writing only inside tile. DepthTest is whether
+  // the z-buffer is enabled.
+  template<class Shading, bool DepthTest>
+  void rasterize_scanline(const int* tri, Framebuffer& render_target,
+                          bool fill, const Tile& tile, RasterState& state);
+  template<class Shading, bool DepthTest>
+  void rasterize_half_space(const int* tri, Framebuffer& render_target,
+                            bool fill, const Tile& tile, RasterState& state);
+
+  // early fragment tests for a single interpolated fragment f
+  // at pixel (y,x). Surviving fragments are queued for shading
+  // (or stored in the G-buffer, when in the G-buffer pass).
+  template<class Shading, bool DepthTest>
+  void fragment_operations(Framebuffer& render_target,
+                            int y, int x, const float* f, const float* dV_dx,
+                            RasterState& state);
+
+  // perspective correction of fragment f and its derivatives,
+  // which are then queued in the batch of state
+  template<class Shading>
+  void queue_fragment(Framebuffer& render_target, int y, int x,
+                      const float* f, const float* dV_dx, RasterState& state);
+
+  // invokes the fragment shader for the queued fragments
+  // and writes them to the framebuffer
+  template<class Shading>
+  void flush_fragments(Framebuffer& render_target, RasterState& state);
+
+  // allocates the per-thread state for the current vertex size.
+  // Called once per frame, right after rewinding the arena
+  void setup_raster_state();
 
 public:
   GraphicPipeline();
@@ -103,7 +444,8 @@ public:
 
   // set shaders. References cannot be const because we'll
   // modify the shader objects by setting their Uniform/Attribute
-  // pointers to the ones allocated by Pipeline
+  // pointers to the ones allocated by Pipeline. This is also
+  // when shaders resolve the slots of the names they use.
   void set_fragment_shader(FragmentShader& fshader);
   void set_vertex_shader(VertexShader& vshader);
 
@@ -121,34 +463,113 @@ public:
   // variable management system working and will be replaced
   // by something that receives a variable and a string ID,
   // just like the attributes
-  void upload_uniform(const std::string& name, const float* data, int n_floats);
-  void upload_uniform(const std::string& name, float d);
+  // Both return the slot of the uniform, which can be used
+  // to upload it again without any name lookup. Uniforms are
+  // updated in place and keep their values until uploaded again.
+  int upload_uniform(const std::string& name, const float* data, int n_floats);
+  int upload_uniform(const std::string& name, float d);
+  void upload_uniform(int slot, const float* data, int n_floats);
+
+  // slot of a given uniform/attribute name. The slot is
+  // reserved if the name was not defined yet.
+  int uniform_slot(const std::string& name);
+  int attribute_slot(const std::string& name);
+
+  // number of threads used by the pipeline (n_threads <= 0 uses
+  // one thread per core). Vertex processing and primitive assembly
+  // always run in parallel, so vertex shaders must not have side
+  // effects; fragment shaders are only invoked concurrently in
+  // tiled mode. The output doesn't depend on the number of threads.
+  void set_threads(int n_threads);
+
+  // enables/disables tiled, multithreaded rasterization (enabling
+  // it also sets the number of threads, as set_threads()). The
+  // output is the same as the single-threaded one, but the fragment
+  // shader will be invoked concurrently, so shaders with side
+  // effects (like OctreeBuilderShader) must not be used in tiled mode.
+  void set_tiled_rasterization(bool enable, int n_threads = 0);
+
+  // selects the triangle rasterization algorithm (RASTER_SCANLINE
+  // by default). This can be changed between render() calls.
+  void set_rasterizer(RasterAlgorithm algorithm);
+
+  // selects the layout of the working vertex buffer
+  // (VERTEX_STREAM_AOS by default). See VertexStream.
+  void set_vertex_stream(VertexStream layout);
+
+  // depth state (DEPTH_LESS with writes enabled by default),
+  // used only when rendering with the z-buffer. Disabling depth
+  // writes keeps the depth test.
+  void set_depth_func(DepthFunc func);
+  void set_depth_write(bool enable);
+
+  // value render targets should clear their depth buffer to
+  // with the current depth function: the far plane (z = 1) or,
+  // for DEPTH_GREATER/DEPTH_GEQUAL, the near one (z = -1)
+  float depth_clear_value() const;
+
+  // enables/disables deferred shading (see above). It has no
+  // effect when rendering without z-buffer, as in this case
+  // every fragment is supposed to reach the fragment shader.
+  void set_deferred_shading(bool enable);
+
+  // how many times the fragment shader was invoked
+  // during the last call to render()
+  int shaded_fragments() const;
+
+  // enables/disables per stage timing (disabled by default).
+  // stage_times() returns the timings of the last render() call,
+  // or zeros if it was not profiled.
+  void set_profiling(bool enable);
+  StageTimes stage_times() const;
+
+  // memory used by the per-frame buffers: current capacity, how
+  // much the last render() call used, the maximum used by a
+  // single call and how many times the arena had to grow
+  ArenaStats scratch_stats() const;
 
   // define viewport. this is not a uniform variable because
   // we need to access it outside the programmable shaders.
   void set_viewport(const mat4& viewport);
 
   // upload a set of floats containing all the attributes
-  // contiguously defined. This can be slow because we make
-  // a copy of this data, as our vertex buffer will be
-  // modified many times during the pipeline.
+  // contiguously defined. This makes a copy of data; use
+  // one of the other versions to avoid it.
   // Besides the actual data, vertex_size informs how many
   // floats makes up a vertex (for example, if a vertex has
   // position and normal information as vec3, vertex_size is 6).
   void upload_data(const std::vector<float>& data, int vertex_size);
 
+  // same as above, but for indexed geometry: every 3 indices
+  // (of vertices in data) make up a triangle.
+  void upload_data(const std::vector<float>& data, int vertex_size,
+                    const std::vector<int>& indices);
+
+  // shares an immutable vertex buffer, which may be uploaded
+  // to many pipelines at once. No copies involved.
+  void upload_data(const VertexBufferRef& buffer);
+
+  // borrows data (and indices, if not null) from the caller,
+  // which must keep them alive and unchanged while rendering
+  void upload_data(const float* data, int n_floats, int vertex_size,
+                    const int* indices = nullptr, int n_indices = 0);
+
   // Define an attribute inside the data uploaded. This
   // attribute is defined by telling how many floats it
   // is comprised of and the stride within the vertex.
-  void define_attribute(const std::string& name, int n_floats, int stride);
+  // Returns the slot of the attribute.
+  int define_attribute(const std::string& name, int n_floats, int stride);
 
   // After setting the attributes and uniforms,
   // render sends them through the pipeline and
-  // stores the final result in the target Framebuffer
+  // stores the final result in the target Framebuffer.
+  // If stats is not null, it receives the pipeline
+  // statistics of this call (see PipelineStats).
   void render(Framebuffer& target, bool zbuffer = true,
                                     bool culling = true,
                                     bool cull_back = true,
-                                    bool fill = true);
+                                    bool fill = true,
+                                    PipelineStats* stats = nullptr);
 };
 
 #endif
@@ -0,0 +1,1068 @@
+#ifndef PIPELINE_STAGES_H
+#define PIPELINE_STAGES_H
+
+// The pipeline stages which invoke shaders or loop over vbuffer
+// elements. They are templates on the shading policy (see
+// VirtualShading in pipeline.h), so they live in a header:
+// pipeline.cpp instantiates them for virtual shaders and
+// SpecializedPipeline for concrete shader types, in which case
+// shader calls are inlined and elem_sz is a compile time constant.
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include "pipeline.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// ---------------------------------------
+// -------------- Utilities --------------
+// ---------------------------------------
+static inline void sub_vertex(const float* lhs, const float* rhs,
+                              float* target, int vertex_sz)
+{
+  for(int i = 0; i < vertex_sz; ++i)
+    target[i] = lhs[i] - rhs[i];
+}
+
+static inline void scalar_vertex(const float* lhs, float k,
+                                  float* target, int vertex_sz)
+{
+  for(int i = 0; i < vertex_sz; ++i)
+    target[i] = lhs[i] * k;
+}
+
+static inline void inc_vertex(float* target, float* inc, int vertex_sz)
+{
+  for(int i = 0; i < vertex_sz; ++i)
+    target[i] += inc[i];
+}
+
+static inline void lerp_vertex(const float* origin, const float* inc, float k,
+                                float* target, int vertex_sz)
+{
+  for(int i = 0; i < vertex_sz; ++i)
+    target[i] = origin[i] + inc[i] * k;
+}
+
+// Coverage test of 8 horizontally adjacent pixels against the
+// three edge functions of a triangle. e[k] is the value of edge
+// function k at the first pixel and step[k][i] = A_k * i its
+// increment for the i-th pixel. Bit i of the result is set if
+// pixel i is inside the triangle (all edge functions >= 0);
+// as we only care about the sign, we OR the three values and
+// check the sign bit of the result.
+static inline unsigned int coverage8(const int* e, const int (*step)[8])
+{
+#if defined(__AVX2__)
+  __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(e[0]), _mm256_loadu_si256((const __m256i*)step[0]));
+  __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(e[1]), _mm256_loadu_si256((const __m256i*)step[1]));
+  __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(e[2]), _mm256_loadu_si256((const __m256i*)step[2]));
+  __m256i all = _mm256_or_si256(e0, _mm256_or_si256(e1, e2));
+  unsigned int outside = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(all));
+  return ~outside & 0xFF;
+#elif defined(__SSE2__)
+  // same as above, in two halves of 4 pixels
+  unsigned int outside = 0;
+  for(int h = 0; h < 2; ++h)
+  {
+    __m128i e0 = _mm_add_epi32(_mm_set1_epi32(e[0]), _mm_loadu_si128((const __m128i*)&step[0][4*h]));
+    __m128i e1 = _mm_add_epi32(_mm_set1_epi32(e[1]), _mm_loadu_si128((const __m128i*)&step[1][4*h]));
+    __m128i e2 = _mm_add_epi32(_mm_set1_epi32(e[2]), _mm_loadu_si128((const __m128i*)&step[2][4*h]));
+    __m128i all = _mm_or_si128(e0, _mm_or_si128(e1, e2));
+    outside |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(all)) << (4*h);
+  }
+  return ~outside & 0xFF;
+#else
+  unsigned int inside = 0;
+  for(int i = 0; i < 8; ++i)
+    if( ((e[0]+step[0][i]) | (e[1]+step[1][i]) | (e[2]+step[2][i])) >= 0 )
+      inside |= 1 << i;
+  return inside;
+#endif
+}
+
+// Clipping happens in homogeneous clip space, against the planes
+// -G*w <= x,y <= G*w (the guard band) and -w <= z <= w. Triangles
+// inside the guard band but crossing the screen borders are not
+// clipped at all: the rasterizers scissor them against the screen
+// (or tile) anyway, and this is by far the most common case. The
+// guard band is kept small, as the scanline rasterizer still walks
+// the rows above the screen.
+static const float GUARD_BAND = 2.0f;
+static const int N_CLIP_PLANES = 6;
+
+// signed distance (up to a scale) of v to clip plane p;
+// v is on the inner side of the plane if it is >= 0
+static inline float plane_distance(const float* v, int p)
+{
+  switch(p)
+  {
+    case 0: return GUARD_BAND*v[3] + v[0];
+    case 1: return GUARD_BAND*v[3] - v[0];
+    case 2: return GUARD_BAND*v[3] + v[1];
+    case 3: return GUARD_BAND*v[3] - v[1];
+    case 4: return v[3] + v[2];
+    default: return v[3] - v[2];
+  }
+}
+
+// bit p is set if v is outside plane p
+static inline int outcode(const float* v)
+{
+  int code = 0;
+  for(int p = 0; p < N_CLIP_PLANES; ++p)
+    if(plane_distance(v, p) < 0.0f) code |= 1 << p;
+  return code;
+}
+
+// outcodes and perspective division of the vertices [first, last)
+// of a SOA vbuffer, same as the per element loop in
+// vertex_processing(). Vertices outside some plane are not divided.
+static inline void clip_divide_soa(float* planes, int stride, int elem_sz,
+                                    unsigned char* codes, int first, int last)
+{
+  float *x = planes, *y = &planes[stride];
+  float *z = &planes[2*stride], *w = &planes[3*stride];
+
+  int e = first;
+#if defined(__AVX__)
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 gb = _mm256_set1_ps(GUARD_BAND);
+  for(; e + 8 <= last; e += 8)
+  {
+    __m256 x8 = _mm256_loadu_ps(&x[e]), y8 = _mm256_loadu_ps(&y[e]);
+    __m256 z8 = _mm256_loadu_ps(&z[e]), w8 = _mm256_loadu_ps(&w[e]);
+    __m256 gw = _mm256_mul_ps(gb, w8);
+
+    // the same distances as plane_distance(), for 8 vertices
+    __m256 out[N_CLIP_PLANES];
+    out[0] = _mm256_cmp_ps(_mm256_add_ps(gw, x8), zero, _CMP_LT_OQ);
+    out[1] = _mm256_cmp_ps(_mm256_sub_ps(gw, x8), zero, _CMP_LT_OQ);
+    out[2] = _mm256_cmp_ps(_mm256_add_ps(gw, y8), zero, _CMP_LT_OQ);
+    out[3] = _mm256_cmp_ps(_mm256_sub_ps(gw, y8), zero, _CMP_LT_OQ);
+    out[4] = _mm256_cmp_ps(_mm256_add_ps(w8, z8), zero, _CMP_LT_OQ);
+    out[5] = _mm256_cmp_ps(_mm256_sub_ps(w8, z8), zero, _CMP_LT_OQ);
+
+    __m256 outside = out[0];
+    int bits[N_CLIP_PLANES];
+    for(int p = 0; p < N_CLIP_PLANES; ++p)
+    {
+      outside = _mm256_or_ps(outside, out[p]);
+      bits[p] = _mm256_movemask_ps(out[p]);
+    }
+
+    for(int j = 0; j < 8; ++j)
+    {
+      int code = 0;
+      for(int p = 0; p < N_CLIP_PLANES; ++p)
+        code |= ((bits[p] >> j) & 1) << p;
+      codes[e+j] = (unsigned char)code;
+    }
+
+    if(_mm256_movemask_ps(outside) == 0xFF) continue;
+
+    // divide everything (w included) by w, keeping the
+    // vertices outside some plane in clip space
+    for(int i = 0; i < elem_sz; ++i)
+    {
+      float *plane = &planes[i*stride + e];
+      __m256 v = _mm256_loadu_ps(plane);
+      _mm256_storeu_ps(plane, _mm256_blendv_ps(_mm256_div_ps(v, w8), v, outside));
+    }
+  }
+#endif
+
+  for(; e < last; ++e)
+  {
+    float v[4] = {x[e], y[e], z[e], w[e]};
+    codes[e] = outcode(v);
+    if(codes[e]) continue;
+
+    for(int i = 0; i < elem_sz; ++i)
+      planes[i*stride + e] /= v[3];
+  }
+}
+
+// -------------------------------------------
+// -------------- Fixed stages ---------------
+// -------------------------------------------
+template<class Shading>
+const float* GraphicPipeline::fetch_vertex(int e, float* tmp) const
+{
+  const int elem_sz = elem_size<Shading>();
+
+  if(vertex_stream == VERTEX_STREAM_AOS) return &vbuffer[e*elem_sz];
+
+  for(int i = 0; i < elem_sz; ++i)
+    tmp[i] = vbuffer[i*vbuffer_stride + e];
+  return tmp;
+}
+
+template<class Shading>
+void GraphicPipeline::run_pipeline(Framebuffer& render_target, bool zbuffer,
+                                    bool culling, bool cull_back, bool fill,
+                                    PipelineStats* stats)
+{
+  //NOTE: In OpenGL architecture, culling happens in the primitive
+  //assembly stage, which is the first part of rasterization
+
+  // uniform_data may have moved since the shaders were bound.
+  // Then shaders compute whatever depends on uniforms only.
+  vshader->uniform_data = uniform_data.data();
+  fshader->uniform_data = uniform_data.data();
+  vshader->prepare();
+  fshader->prepare();
+
+  // everything allocated by the last frame is released here
+  arena.reset();
+  setup_raster_state();
+  times = StageTimes();
+
+  double start = profiling ? clock_seconds() : 0.0;
+  vertex_processing<Shading>();
+
+  if(profiling)
+  {
+    double wall = clock_seconds() - start;
+    times.vertex = sub_stage_time(wall);
+    times.divide = wall - times.vertex;
+    start = clock_seconds();
+  }
+
+  ibuffer_sz = primitive_assembly(culling, cull_back);
+
+  if(profiling)
+  {
+    times.cull = clock_seconds() - start - times.clip;
+    start = clock_seconds();
+  }
+
+  // without depth testing, every fragment must be shaded
+  gbuffer_pass = deferred && zbuffer;
+  if(gbuffer_pass)
+  {
+    // we store both the fragment and its x derivatives
+    render_target.resizeGBuffer(2*vbuffer_elem_sz);
+    render_target.clearGBuffer();
+  }
+
+  rasterization<Shading>(render_target, zbuffer, fill);
+
+  if(profiling)
+  {
+    times.raster = clock_seconds() - start - times.fragment;
+    start = clock_seconds();
+  }
+
+  if(gbuffer_pass) deferred_shading<Shading>(render_target);
+  if(profiling) times.fragment += clock_seconds() - start;
+
+  if(!stats) return;
+
+  // the per-thread counters add up to the whole frame
+  *stats = PipelineStats();
+#if PIPELINE_STATS
+  for(auto st = raster_state.begin(); st != raster_state.end(); ++st)
+  {
+    stats->vertices_shaded += st->stats.vertices_shaded;
+    stats->triangles_clipped += st->stats.triangles_clipped;
+    stats->triangles_culled += st->stats.triangles_culled;
+    stats->fragments_generated += st->stats.fragments_generated;
+    stats->fragments_depth_failed += st->stats.fragments_depth_failed;
+    stats->pixels_written += st->stats.pixels_written;
+  }
+  stats->triangles_rasterized = ibuffer_sz / 3;
+  stats->fragment_shader_invocations = n_shaded;
+#endif
+}
+
+template<class Shading>
+void GraphicPipeline::vertex_processing()
+{
+  const int elem_sz = elem_size<Shading>();
+
+  // vbuffer goes last, so primitive_assembly() can
+  // grow it in place if clipping creates vertices
+  vcodes = arena.allocate<unsigned char>(n_vertices);
+  vbuffer_stride = (n_vertices + 7) / 8 * 8;
+  vbuffer_sz = (vertex_stream == VERTEX_STREAM_SOA ? vbuffer_stride
+                                                   : n_vertices) * elem_sz;
+  vbuffer = arena.allocate<float>(vbuffer_sz);
+
+  // vertices are independent, so chunks of VERTEX_CHUNK
+  // vertices are processed in parallel
+  int n_chunks = (n_vertices + VERTEX_CHUNK-1) / VERTEX_CHUNK;
+  pool.run(n_chunks, [&](int chunk, int thread_id)
+  {
+    int first = chunk * VERTEX_CHUNK;
+    int last = std::min(first + VERTEX_CHUNK, n_vertices);
+
+    // input data to vertex shader (akin to the "in" variables
+    // in GLSL) is the raw vbuffer_in. Output data (akin to the
+    // "out" variables in GLSL) are the elements in the vbuffer:
+    // the first 4 floats receive the vertex position and the
+    // attributes come right after it. The attribute "1" in the
+    // end must remain untouched by the shader.
+    // vertices are shaded in batches, so we pay a single virtual
+    // call (and uniform fetching) every VERTEX_BATCH vertices.
+    double start = profiling ? clock_seconds() : 0.0;
+    bool soa = vertex_stream == VERTEX_STREAM_SOA;
+
+    if(soa)
+    {
+      // the shader still writes whole elements, which we
+      // scatter to the planes of vbuffer
+      float *out = raster_state[thread_id].vertices;
+      for(int v = first; v < last; v += VERTEX_BATCH)
+      {
+        int count = std::min(VERTEX_BATCH, last - v);
+        Shading::shade_vertices(vshader, &vbuffer_in[v*vertex_size], out,
+                                count, vertex_size, elem_sz);
+
+        for(int i = 0; i < elem_sz-1; ++i)
+        {
+          float *plane = &vbuffer[i*vbuffer_stride + v];
+          for(int e = 0; e < count; ++e) plane[e] = out[e*elem_sz + i];
+        }
+        std::fill_n(&vbuffer[(elem_sz-1)*vbuffer_stride + v], count, 1.0f);
+      }
+    }
+    else
+    {
+      for(int v = first; v < last; v += VERTEX_BATCH)
+      {
+        int count = std::min(VERTEX_BATCH, last - v);
+        Shading::shade_vertices(vshader, &vbuffer_in[v*vertex_size],
+                                &vbuffer[v*elem_sz],
+                                count, vertex_size, elem_sz);
+      }
+    }
+
+    double shaded = profiling ? clock_seconds() : 0.0;
+
+    if(soa)
+      clip_divide_soa(vbuffer, vbuffer_stride, elem_sz, vcodes, first, last);
+    else
+    {
+      for(int e = first; e < last; ++e)
+      {
+        float *v = &vbuffer[e*elem_sz];
+        v[elem_sz-1] = 1.0f;
+
+        // perspective division: divide the element by w (which
+        // we know to be the fourth element of the array), once
+        // per vertex no matter how many triangles share it.
+        // Vertices outside some clip plane are only used by
+        // triangles which will be clipped, so we leave them in
+        // clip space.
+        vcodes[e] = outcode(v);
+        if(vcodes[e]) continue;
+
+        float w = v[3];
+        for(int i = 0; i < elem_sz; ++i)
+          v[i] /= w;
+      }
+    }
+
+    RasterState& state = raster_state[thread_id];
+    PIPELINE_STAT(state.stats.vertices_shaded, last - first);
+
+    if(profiling)
+    {
+      state.sub_time += shaded - start;
+      state.busy_time += clock_seconds() - start;
+    }
+  });
+}
+
+// number of vbuffer elements used as rasterization registers.
+// The last one holds the vertices fetched from a SOA vbuffer.
+static const int N_RASTER_REGS = 11;
+
+template<class Shading, bool DepthTest>
+void GraphicPipeline::fragment_operations(Framebuffer& render_target,
+                                          int y, int x,
+                                          const float* f, const float* dV_dx,
+                                          RasterState& state)
+{
+  const int elem_sz = elem_size<Shading>();
+
+  // To better represent what the pipeline does, we should, in the
+  // following order:
+  //
+  // 1) perform early fragment tests at this point (which include
+  // depth buffering, scissor testing and stencil buffering, for
+  // for example), which decide whether this fragment will live
+  // or not. Notice that at this point, a fragment is the set of
+  // attributes interpolated by the rasterizer;
+  //
+  // 2) evaluate fragment shader to compute a pixel sample from the
+  // fragment's attributes;
+  //
+  // 3) perform per-sample operations like alpha
+  // blending using the sample computed in the previous stage;
+  //
+  // It is interesting to notice that, as of version 4.6, the OpenGL
+  // specification calls "per-fragment
+  // operations" both early fragment tests (which MAY be performed
+  // before or after fragment shader evaluation, but executing before
+  // allows us to discard fragments without evaluating them) and
+  // per-sample operations (like like alpha blending, dithering and
+  // sRGB conversions), which MUST be performed after fragment shader
+  // evaluation because we need a pixel sample.
+
+  // Here we mixed things in the same code for simplicity.
+  // Execute fragment operations if zbuffer is disabled or
+  // the fragment passes the depth test against the one stored
+  // in z-buffer. Without z-buffer, this is compiled out and
+  // the depth buffer is not touched at all.
+  PIPELINE_STAT(state.stats.fragments_generated, 1);
+
+  if(DepthTest) // early fragment tests
+  {
+    if(!depth_test(f[2], render_target.getDepthBuffer(y,x)))
+    {
+      PIPELINE_STAT(state.stats.fragments_depth_failed, 1);
+      return;
+    }
+
+    if(depth_write) render_target.setDepthBuffer(y, x, f[2]);
+  }
+
+  // in the G-buffer pass we just store the fragment
+  // and let deferred_shading() shade it later, if it
+  // is not overwritten by some other fragment. Without
+  // depth writes, the last fragment passing the test
+  // wins, just like it would when shading right away.
+  if(gbuffer_pass)
+  {
+    float *g = render_target.gBufferWrite(y, x);
+    memcpy(g, f, elem_sz*sizeof(float));
+    memcpy(&g[elem_sz], dV_dx, elem_sz*sizeof(float));
+    return;
+  }
+
+  queue_fragment<Shading>(render_target, y, x, f, dV_dx, state);
+}
+
+template<class Shading>
+void GraphicPipeline::queue_fragment(Framebuffer& render_target, int y, int x,
+                                      const float* f, const float* dV_dx,
+                                      RasterState& state)
+{
+  const int elem_sz = elem_size<Shading>();
+
+  int i = state.n_frags++;
+
+  // perspectively-correct interpolation of attributes
+  // and derivatives
+  scalar_vertex(f, 1.0f/f[3], &state.frags[i*elem_sz], elem_sz);
+  scalar_vertex(dV_dx, 1.0f/f[3], &state.dVdx[i*elem_sz], elem_sz);
+  state.frag_x[i] = x;
+  state.frag_y[i] = y;
+
+  if(state.n_frags == FRAGMENT_BATCH)
+    flush_fragments<Shading>(render_target, state);
+}
+
+template<class Shading>
+void GraphicPipeline::flush_fragments(Framebuffer& render_target,
+                                      RasterState& state)
+{
+  const int elem_sz = elem_size<Shading>();
+
+  if(!state.n_frags) return;
+  double start = profiling ? clock_seconds() : 0.0;
+
+  // invoke fragment shader for the interpolated fragments
+  Shading::shade_fragments(fshader, state.frags, state.dVdx,
+                           state.n_frags, elem_sz, state.colors);
+
+  // write to framebuffer. Fragments are written in the order they
+  // were queued, so if the same pixel was queued twice (by different
+  // triangles) the last one wins, just like without batching.
+  for(int i = 0; i < state.n_frags; ++i)
+  {
+    const rgba& frag_color = state.colors[i];
+
+    RGBA8 color_ubyte;
+    color_ubyte.r = std::min(255, (int)(frag_color(0)*255.0f));
+    color_ubyte.g = std::min(255, (int)(frag_color(1)*255.0f));
+    color_ubyte.b = std::min(255, (int)(frag_color(2)*255.0f));
+    color_ubyte.a = std::min(255, (int)(frag_color(3)*255.0f));
+
+    render_target.setColorBuffer(state.frag_y[i], state.frag_x[i], color_ubyte);
+  }
+
+  PIPELINE_STAT(state.stats.pixels_written, state.n_frags);
+  state.shaded += state.n_frags;
+  state.n_frags = 0;
+
+  if(profiling) state.sub_time += clock_seconds() - start;
+}
+
+template<class Shading>
+void GraphicPipeline::deferred_shading(Framebuffer& render_target)
+{
+  const int elem_sz = elem_size<Shading>();
+
+  // one task per row. Rows have no dependencies between
+  // them and each pixel is shaded exactly once.
+  for(auto st = raster_state.begin(); st != raster_state.end(); ++st)
+    st->shaded = 0;
+
+  auto shade_row = [&](int y, int thread_id)
+  {
+    RasterState& state = raster_state[thread_id];
+
+    for(int x = 0; x < render_target.width(); ++x)
+    {
+      const float *g = render_target.gBufferRead(y, x);
+      if(g) queue_fragment<Shading>(render_target, y, x, g, &g[elem_sz], state);
+    }
+
+    flush_fragments<Shading>(render_target, state);
+  };
+
+  // fragment shaders only run concurrently in tiled mode
+  if(tiled) pool.run(render_target.height(), shade_row);
+  else for(int y = 0; y < render_target.height(); ++y) shade_row(y, 0);
+
+  n_shaded = 0;
+  for(auto st = raster_state.begin(); st != raster_state.end(); ++st)
+    n_shaded += st->shaded;
+}
+
+template<class Shading>
+void GraphicPipeline::rasterization(Framebuffer& render_target, bool zbuffer,
+                                    bool fill)
+{
+  // the z-buffer switch is resolved here, once per frame, so the
+  // rasterizers have no depth path at all when it is disabled
+  typedef void (GraphicPipeline::*RasterFn)(const int*, Framebuffer&,
+                                            bool, const Tile&,
+                                            RasterState&);
+  RasterFn rasterize_triangle;
+  if(raster_algorithm == RASTER_HALF_SPACE)
+    rasterize_triangle = zbuffer ? &GraphicPipeline::rasterize_half_space<Shading, true> :
+                                    &GraphicPipeline::rasterize_half_space<Shading, false>;
+  else
+    rasterize_triangle = zbuffer ? &GraphicPipeline::rasterize_scanline<Shading, true> :
+                                    &GraphicPipeline::rasterize_scanline<Shading, false>;
+
+  if(!tiled)
+  {
+    Tile screen = {0, 0, render_target.width(), render_target.height()};
+    for(int t = 0; t < ibuffer_sz; t += 3)
+      (this->*rasterize_triangle)(&ibuffer[t], render_target, fill,
+                                  screen, raster_state[0]);
+
+    flush_fragments<Shading>(render_target, raster_state[0]);
+    n_shaded = raster_state[0].shaded;
+
+    // single threaded: no need to split anything
+    times.fragment = raster_state[0].sub_time;
+    return;
+  }
+
+  // ---------- binning ----------
+  int tiles_x = (render_target.width() + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (render_target.height() + TILE_SIZE - 1) / TILE_SIZE;
+
+  int n_tiles = tiles_x * tiles_y, n_tris = ibuffer_sz / 3;
+
+  // bins are stored contiguously: the offsets (inside ibuffer) of
+  // the triangles overlapping tile i, in submission order, are
+  // bin_tris[bin_start[i]] ... bin_tris[bin_start[i+1]-1]. We first
+  // count the triangles per tile, remembering the tile range of
+  // each triangle, then fill the bins.
+  int *bin_start = arena.allocate<int>(n_tiles + 1);
+  int *tri_tiles = arena.allocate<int>(4 * n_tris);
+  memset(bin_start, 0, (n_tiles + 1)*sizeof(int));
+
+  for(int t = 0; t < ibuffer_sz; t += 3)
+  {
+    // screen bounding box of the triangle, computed exactly
+    // as the rasterizers will place its vertices
+    int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+    for(int v_id = 0; v_id < 3; ++v_id)
+    {
+      int e = ibuffer[t + v_id];
+      vec4 p = viewport*vec4(vertex_component(e, 0), vertex_component(e, 1),
+                              1.0f, 1.0f);
+      int x = (int)floorf(p(0) + 0.5f), y = (int)floorf(p(1) + 0.5f);
+
+      min_x = std::min(min_x, x); max_x = std::max(max_x, x);
+      min_y = std::min(min_y, y); max_y = std::max(max_y, y);
+    }
+
+    // triangles are allowed to lie partially outside the
+    // screen, so clamp the tile range
+    int tx0 = std::max(0, min_x / TILE_SIZE);
+    int ty0 = std::max(0, min_y / TILE_SIZE);
+    int tx1 = std::min(tiles_x-1, max_x / TILE_SIZE);
+    int ty1 = std::min(tiles_y-1, max_y / TILE_SIZE);
+
+    int *range = &tri_tiles[4*(t/3)];
+    range[0] = tx0; range[1] = ty0; range[2] = tx1; range[3] = ty1;
+
+    for(int ty = ty0; ty <= ty1; ++ty)
+      for(int tx = tx0; tx <= tx1; ++tx)
+        bin_start[ty*tiles_x + tx + 1]++;
+  }
+
+  for(int i = 0; i < n_tiles; ++i)
+    bin_start[i+1] += bin_start[i];
+
+  int *bin_tris = arena.allocate<int>(bin_start[n_tiles]);
+  int *bin_end = arena.allocate<int>(n_tiles);
+  memcpy(bin_end, bin_start, n_tiles*sizeof(int));
+
+  for(int t = 0; t < ibuffer_sz; t += 3)
+  {
+    const int *range = &tri_tiles[4*(t/3)];
+    for(int ty = range[1]; ty <= range[3]; ++ty)
+      for(int tx = range[0]; tx <= range[2]; ++tx)
+        bin_tris[bin_end[ty*tiles_x + tx]++] = t;
+  }
+
+  // ---------- tile rasterization ----------
+  // each tile is owned by exactly one thread, which processes
+  // its triangles in submission order. As fragments are only
+  // written inside the tile, the depth test sees exactly the
+  // same sequence of fragments per pixel as in the single
+  // threaded case and the result is the same.
+  double pass_start = profiling ? clock_seconds() : 0.0;
+  pool.run(tiles_x * tiles_y, [&](int tile_id, int thread_id)
+  {
+    const int *first = &bin_tris[bin_start[tile_id]];
+    const int *last = &bin_tris[bin_start[tile_id+1]];
+    if(first == last) return;
+
+    double start = profiling ? clock_seconds() : 0.0;
+
+    Tile tile;
+    tile.x0 = (tile_id % tiles_x) * TILE_SIZE;
+    tile.y0 = (tile_id / tiles_x) * TILE_SIZE;
+    tile.x1 = std::min(tile.x0 + TILE_SIZE, render_target.width());
+    tile.y1 = std::min(tile.y0 + TILE_SIZE, render_target.height());
+
+    RasterState& state = raster_state[thread_id];
+    for(const int *t = first; t != last; ++t)
+      (this->*rasterize_triangle)(&ibuffer[*t], render_target, fill,
+                                  tile, state);
+
+    flush_fragments<Shading>(render_target, state);
+    if(profiling) state.busy_time += clock_seconds() - start;
+  });
+
+  if(profiling) times.fragment = sub_stage_time(clock_seconds() - pass_start);
+
+  n_shaded = 0;
+  for(auto st = raster_state.begin(); st != raster_state.end(); ++st)
+    n_shaded += st->shaded;
+}
+
+template<class Shading, bool DepthTest>
+void GraphicPipeline::rasterize_scanline(const int* tri,
+                                          Framebuffer& render_target,
+                                          bool fill, const Tile& tile,
+                                          RasterState& state)
+{
+  const int elem_sz = elem_size<Shading>();
+
+  // akin to an assembly move. This will (should) be used for
+  // buffers of the same size only, so we don't need the size
+  // as parameter.
+  #define MOVE(s,t) { memcpy(t, s, elem_sz*sizeof(float)); }
+  #define ROUND(x) ((int)floorf((x) + 0.5f))
+  #define SWAP(a,b) { float* aux = b; b = a; a = aux; }
+  #define X(x) (x[0])
+  #define Y(x) (x[1])
+  #define Z(x) (x[2])
+  #define W(x) (x[3])
+
+  float *regs = state.regs;
+  float *v0 = &regs[0*elem_sz];
+  float *v1 = &regs[1*elem_sz];
+  float *v2 = &regs[2*elem_sz];
+
+  float* dV0_dy = &regs[3*elem_sz];
+  float* dV1_dy = &regs[4*elem_sz];
+  float* dV2_dy = &regs[5*elem_sz];
+
+  float *start = &regs[6*elem_sz];  //starting fragment in scanline
+  float *end = &regs[7*elem_sz];    //ending fragment in scanline
+  float *dV_dx = &regs[8*elem_sz];  //horizontal increment
+  float *f = &regs[9*elem_sz];      //bilinearly interpolated fragment
+  float *fetched = &regs[10*elem_sz];//vertices fetched from a SOA vbuffer
+
+  //we need x and y positions mapped to the viewport and
+  //with integer coordinates, otherwise we'll have displacements
+  //for start and end which are huge when 0 < dy < 1;
+  //these cases must be treated as straight, horizontal lines.
+  //TODO: THIS IS CORRECT BUT CODE IS SHITTY
+  const float *v0_ = fetch_vertex<Shading>(tri[0], fetched);
+  vec4 pos0 = viewport*vec4(v0_[0], v0_[1], 1.0f, 1.0f);
+  X(v0) = ROUND(pos0(0)); Y(v0) = ROUND(pos0(1));
+  Z(v0) = v0_[2]; W(v0) = v0_[elem_sz-1];
+  memcpy(&v0[4], &v0_[4], (elem_sz-4)*sizeof(float));
+
+  const float *v1_ = fetch_vertex<Shading>(tri[1], fetched);
+  vec4 pos1 = viewport*vec4(v1_[0], v1_[1], 1.0f, 1.0f);
+  X(v1) = ROUND(pos1(0)); Y(v1) = ROUND(pos1(1));
+  Z(v1) = v1_[2]; W(v1) = v1_[elem_sz-1];
+  memcpy(&v1[4], &v1_[4], (elem_sz-4)*sizeof(float));
+
+  const float *v2_ = fetch_vertex<Shading>(tri[2], fetched);
+  vec4 pos2 = viewport*vec4(v2_[0], v2_[1], 1.0f, 1.0f);
+  X(v2) = ROUND(pos2(0)); Y(v2) = ROUND(pos2(1));
+  Z(v2) = v2_[2]; W(v2) = v2_[elem_sz-1];
+  memcpy(&v2[4], &v2_[4], (elem_sz-4)*sizeof(float));
+
+  //order vertices by y coordinate
+  if( Y(v0) > Y(v1) ) SWAP(v0, v1);
+  if( Y(v0) > Y(v2) ) SWAP(v0, v2);
+  if( Y(v1) > Y(v2) ) SWAP(v1, v2);
+
+  //hierarchical depth test: bail out if the whole triangle
+  //is behind what is already in the depth buffer, before doing
+  //any interpolation
+  const int HIZ_TILE = Framebuffer::HIZ_TILE;
+  const bool hiz = DepthTest && hiz_usable();
+  const bool pass_equal = depth_func != DEPTH_LESS;
+  float min_z = std::min(Z(v0), std::min(Z(v1), Z(v2)));
+  if(hiz)
+  {
+    int min_x = std::max(tile.x0, (int)std::min(X(v0), std::min(X(v1), X(v2))));
+    int max_x = std::min(tile.x1-1, (int)std::max(X(v0), std::max(X(v1), X(v2))));
+    int min_y = std::max(tile.y0, (int)Y(v0));
+    int max_y = std::min(tile.y1-1, (int)Y(v2));
+
+    if(min_x > max_x || min_y > max_y ||
+        render_target.occluded(min_y, min_x, max_y, max_x, min_z, pass_equal))
+      return;
+  }
+
+  //these dVdy_ variables define how much we must
+  //increment v when increasing one unit in y, so
+  //we can use this to compute the start and end
+  //boundaries for rasterization. Notice that not
+  //only this defines the actual x coordinate of the
+  //fragment in the scanline, but all the other
+  //attributes. Also, notice that y is integer and
+  //thus if we make dy0 = (v1.y-v0.y) steps in y, for intance,
+  //incrementing v0 with dVdy0 at each step, by the end of
+  //the dy steps we'll have:
+  //
+  // v0 + dy0 * dVdy0 = v0 + dy0*(v1-v0)/dy0 = v0 + v1 - v0 = v1
+  //
+  //which is exactly what we want, a linear interpolation
+  //between v0 and v1 with dy0 steps
+  sub_vertex(v1, v0, dV0_dy, elem_sz);
+  scalar_vertex(dV0_dy, 1.0f/(Y(v1)-Y(v0)), dV0_dy, elem_sz);
+
+  sub_vertex(v2, v0, dV1_dy, elem_sz);
+  scalar_vertex(dV1_dy, 1.0f/(Y(v2)-Y(v0)), dV1_dy, elem_sz);
+
+  sub_vertex(v2, v1, dV2_dy, elem_sz);
+  scalar_vertex(dV2_dy, 1.0f/(Y(v2)-Y(v1)), dV2_dy, elem_sz);
+
+  // these pointers store the current increment for starting
+  // ending segments
+  float *dStart_dy, *dEnd_dy;
+
+  //this will tell us whether we should change dStart_dy
+  //or dEnd_dy to the next active edge (dV2_dy) when we
+  //reach halfway the triangle
+  float **next_active_edge;
+
+  //decide start/end edges. If v1 is to the left
+  //side of the edge connecting v0 and v2, then v0v1
+  //is the starting edge and v0v2 is the ending edge;
+  //if v1 is to the right, it is the contrary.
+  //the v0v1 edge will be substituted by the v1v2 edge
+  //when we reach the v1 vertex while scanlining, so we
+  //store which of the start/end edges we should replace
+  //with v1v2.
+  vec3 right_side = vec3(X(v1)-X(v0), Y(v1)-Y(v0), 0.0f).cross(vec3(X(v2)-X(v0), Y(v2)-Y(v0), 0.0f));
+  if( right_side(2) > 0.0f )
+  {
+    dEnd_dy = dV0_dy;
+    dStart_dy = dV1_dy;
+    next_active_edge = &dEnd_dy;
+  }
+  else
+  {
+    dEnd_dy = dV1_dy;
+    dStart_dy = dV0_dy;
+    next_active_edge = &dStart_dy;
+  }
+
+  //handle flat top triangles
+  if( Y(v0) == Y(v1) )
+  {
+    //switch active edge and update
+    //starting and ending points
+    if( X(v0) < X(v1) )
+    {
+      dEnd_dy = dV2_dy;
+      //start = v0; end = v1;
+      MOVE(v0, start);
+      MOVE(v1, end);
+    }
+    else
+    {
+      dStart_dy = dV2_dy;
+      //start = v1; end = v0;
+      MOVE(v1, start);
+      MOVE(v0, end);
+    }
+  }
+  else
+  {
+    //start = end = v0;
+    MOVE(v0, start);
+    MOVE(v0, end);
+  }
+
+  //loop over scanlines. Scanlines above the tile must still
+  //be walked so start/end are incremented, but the ones below
+  //it are of no interest.
+  for(int y = Y(v0); y <= Y(v2) && y < tile.y1; ++y)
+  {
+    if(y >= tile.y0)
+    {
+      //starting and ending points for scanline rasterization.
+      //Fragments outside the tile (or the screen) are skipped,
+      //so we never write to invalid positions of the color/depth
+      //buffer.
+      int s = ROUND(X(start)), e = ROUND(X(end));
+      int xs = std::max(s, tile.x0), xe = std::min(e, tile.x1-1);
+
+      // compute horizontal increment dV_dx
+      sub_vertex(end, start, dV_dx, elem_sz);
+      scalar_vertex(dV_dx, 1.0f/(e-s), dV_dx, elem_sz);
+
+      for(int x = xs; x <= xe; ++x)
+      {
+        //in order to draw only the edges, we skip this
+        //the scanline rasterization in all points but
+        //the extremities.
+        if(!fill && (x != s && x != e)) continue;
+
+        // skip the part of the span inside a hierarchical depth
+        // tile whose pixels are all in front of the triangle
+        if(hiz && (x == xs || x % HIZ_TILE == 0) &&
+            render_target.occluded(y, x, y, x, min_z, pass_equal))
+        {
+          x = (x/HIZ_TILE)*HIZ_TILE + HIZ_TILE-1;
+          continue;
+        }
+
+        // compute the actual fragment. We don't accumulate dV_dx
+        // along the scanline, but compute f directly from the
+        // distance to the starting point: this way, the fragment
+        // doesn't depend on where the tile starts and tiled and
+        // non-tiled rasterization produce the very same output.
+        if(x == s) MOVE(start, f)
+        else lerp_vertex(start, dV_dx, (float)(x-s), f, elem_sz);
+
+        fragment_operations<Shading, DepthTest>(render_target, y, x, f, dV_dx, state);
+      }
+    }
+
+    //switch active edges if halfway through the triangle
+    //This MUST be done before incrementing, otherwise
+    //once we reached v1 we would pass through it and
+    //start coming back only in the next step, causing
+    //the big "leaking" triangles!
+    if( y == (int)Y(v1) ) *next_active_edge = dV2_dy;
+
+    //increment bounds
+    inc_vertex(start, dStart_dy, elem_sz);
+    inc_vertex(end, dEnd_dy, elem_sz);
+  }
+
+  #undef MOVE
+  #undef ROUND
+  #undef SWAP
+  #undef X
+  #undef Y
+  #undef Z
+  #undef W
+}
+
+template<class Shading, bool DepthTest>
+void GraphicPipeline::rasterize_half_space(const int* tri,
+                                            Framebuffer& render_target,
+                                            bool fill, const Tile& tile,
+                                            RasterState& state)
+{
+  const int elem_sz = elem_size<Shading>();
+
+  // pixels are tested in blocks of BLOCK x BLOCK, each row
+  // of a block being tested at once by coverage8(). Blocks
+  // match the tiles of the hierarchical depth buffer.
+  const int BLOCK = Framebuffer::HIZ_TILE;
+
+  float *regs = state.regs;
+  const float *v[3];
+  v[0] = &regs[0*elem_sz];
+  v[1] = &regs[1*elem_sz];
+  v[2] = &regs[2*elem_sz];
+
+  float *dV_dx = &regs[3*elem_sz];  //attribute plane, x derivative
+  float *dV_dy = &regs[4*elem_sz];  //attribute plane, y derivative
+  float *row = &regs[5*elem_sz];    //attribute plane at (0,y)
+  float *f = &regs[6*elem_sz];      //linearly interpolated fragment
+  float *fetched = &regs[7*elem_sz];//vertices fetched from a SOA vbuffer
+
+  // map vertices to the viewport and round them to integer
+  // coordinates, just like the scanline rasterizer. This keeps
+  // both algorithms (and tile binning) consistent and makes the
+  // edge functions exact integer arithmetic.
+  int x[3], y[3];
+  for(int k = 0; k < 3; ++k)
+  {
+    const float *v_ = fetch_vertex<Shading>(tri[k], fetched);
+    float *target = &regs[k*elem_sz];
+
+    vec4 p = viewport*vec4(v_[0], v_[1], 1.0f, 1.0f);
+    x[k] = (int)floorf(p(0) + 0.5f); y[k] = (int)floorf(p(1) + 0.5f);
+
+    target[0] = x[k]; target[1] = y[k];
+    target[2] = v_[2]; target[3] = v_[elem_sz-1];
+    memcpy(&target[4], &v_[4], (elem_sz-4)*sizeof(float));
+  }
+
+  // twice the signed area of the triangle. Make the triangle
+  // consistently oriented so that the inside of every edge is
+  // where its edge function is positive.
+  int area = (x[1]-x[0])*(y[2]-y[0]) - (y[1]-y[0])*(x[2]-x[0]);
+  if(area == 0) return;
+  if(area < 0)
+  {
+    std::swap(x[1], x[2]); std::swap(y[1], y[2]); std::swap(v[1], v[2]);
+    area = -area;
+  }
+
+  // bounding box, clamped to the tile
+  int min_x = std::max(tile.x0, std::min(x[0], std::min(x[1], x[2])));
+  int min_y = std::max(tile.y0, std::min(y[0], std::min(y[1], y[2])));
+  int max_x = std::min(tile.x1-1, std::max(x[0], std::max(x[1], x[2])));
+  int max_y = std::min(tile.y1-1, std::max(y[0], std::max(y[1], y[2])));
+  if(min_x > max_x || min_y > max_y) return;
+
+  // hierarchical depth test for the whole triangle
+  const bool hiz = DepthTest && hiz_usable();
+  const bool pass_equal = depth_func != DEPTH_LESS;
+  float min_z = std::min(v[0][2], std::min(v[1][2], v[2][2]));
+  if(hiz && render_target.occluded(min_y, min_x, max_y, max_x, min_z, pass_equal))
+    return;
+
+  // edge function k is E_k(x,y) = A_k*x + B_k*y + C_k for the edge
+  // opposite to vertex k (so E_k/area is the barycentric coordinate
+  // of vertex k).
+  // Top-left fill rule: pixels lying exactly on an edge belong to the
+  // triangle only if it is a left edge (inside lies to its right,
+  // A > 0) or a top edge (horizontal with inside below, A == 0 and
+  // B > 0). For the other edges we subtract 1 from C, which turns
+  // E >= 0 into E > 0, as everything is integer.
+  int A[3], B[3], C[3];
+  for(int k = 0; k < 3; ++k)
+  {
+    int a = (k+1)%3, b = (k+2)%3;
+    A[k] = y[a] - y[b];
+    B[k] = x[b] - x[a];
+    C[k] = x[a]*y[b] - x[b]*y[a];
+
+    bool top_left = A[k] > 0 || (A[k] == 0 && B[k] > 0);
+    if(!top_left) C[k] -= 1;
+  }
+
+  int step[3][8];
+  for(int k = 0; k < 3; ++k)
+    for(int i = 0; i < 8; ++i)
+      step[k][i] = A[k]*i;
+
+  // attribute planes. Every attribute (including screen position,
+  // depth and 1/w) varies linearly in screen space:
+  //
+  // V(x,y) = V0 + dV_dx*(x-x0) + dV_dy*(y-y0)
+  //
+  // dV_dx plays the same role as the scanline horizontal increment
+  // and is passed (perspective corrected) to the fragment shader.
+  float inv_area = 1.0f / area;
+  for(int i = 0; i < elem_sz; ++i)
+  {
+    dV_dx[i] = (A[0]*v[0][i] + A[1]*v[1][i] + A[2]*v[2][i]) * inv_area;
+    dV_dy[i] = (B[0]*v[0][i] + B[1]*v[1][i] + B[2]*v[2][i]) * inv_area;
+  }
+
+  // scalar coverage test, used only for wireframe rendering
+  auto inside = [&](int px, int py) -> bool {
+    return ((A[0]*px + B[0]*py + C[0]) |
+            (A[1]*px + B[1]*py + C[1]) |
+            (A[2]*px + B[2]*py + C[2])) >= 0;
+  };
+
+  // loop over blocks aligned to the BLOCK grid
+  for(int by = min_y - (min_y % BLOCK); by <= max_y; by += BLOCK)
+    for(int bx = min_x - (min_x % BLOCK); bx <= max_x; bx += BLOCK)
+    {
+      // trivially reject blocks entirely outside one of the edges:
+      // evaluate each edge function on the block corner where
+      // it is maximum
+      bool outside = false;
+      for(int k = 0; k < 3 && !outside; ++k)
+      {
+        int cx = A[k] > 0 ? bx + BLOCK-1 : bx;
+        int cy = B[k] > 0 ? by + BLOCK-1 : by;
+        outside = A[k]*cx + B[k]*cy + C[k] < 0;
+      }
+      if(outside) continue;
+
+      // reject blocks hidden behind the depth buffer
+      if(hiz && render_target.occluded(by, bx, by, bx, min_z, pass_equal))
+        continue;
+
+      // pixels of the block row which are inside the bounding box
+      unsigned int bbox_mask = 0xFF;
+      if(bx < min_x) bbox_mask &= 0xFF << (min_x - bx);
+      if(bx + BLOCK-1 > max_x) bbox_mask &= 0xFF >> (bx + BLOCK-1 - max_x);
+
+      int y0 = std::max(by, min_y), y1 = std::min(by + BLOCK-1, max_y);
+      for(int py = y0; py <= y1; ++py)
+      {
+        int e[3];
+        for(int k = 0; k < 3; ++k)
+          e[k] = A[k]*bx + B[k]*py + C[k];
+
+        unsigned int mask = coverage8(e, step) & bbox_mask;
+        if(!mask) continue;
+
+        // attributes at (0, py)
+        lerp_vertex(v[0], dV_dy, (float)(py - y[0]), row, elem_sz);
+        lerp_vertex(row, dV_dx, (float)(-x[0]), row, elem_sz);
+
+        for(; mask; mask &= mask-1)
+        {
+          int px = bx + __builtin_ctz(mask);
+
+          // in wireframe mode, keep only the pixels on the
+          // horizontal extremities of each span
+          if(!fill && inside(px-1, py) && inside(px+1, py)) continue;
+
+          lerp_vertex(row, dV_dx, (float)px, f, elem_sz);
+          fragment_operations<Shading, DepthTest>(render_target, py, px, f, dV_dx,
+                                                  state);
+        }
+      }
+    }
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef SPECIALIZED_PIPELINE_H
+#define SPECIALIZED_PIPELINE_H
+
+#include <vector>
+#include <cstdio>
+#include "pipeline.h"
+#include "pipelinestages.h"
+
+// Number of floats per input vertex, known at compile time.
+template<int N>
+struct VertexLayout
+{
+  static const int VERTEX_SIZE = N;
+};
+
+// Shading policy calling the launch_batch() of VS and FS directly.
+// The qualified calls are not virtual, so shaders defining their
+// launch_batch() in the header are inlined into the raster loop.
+template<class VS, class FS, class Layout>
+struct StaticShading
+{
+  static const int ELEM_SZ = 4 + Layout::VERTEX_SIZE + 1;
+
+  static void shade_vertices(VertexShader* vs, const float* vertex_in,
+                              float* vertex_out, int count,
+                              int in_stride, int out_stride)
+  {
+    static_cast<VS*>(vs)->VS::launch_batch(vertex_in, vertex_out, count,
+                                            in_stride, out_stride);
+  }
+
+  static void shade_fragments(FragmentShader* fs, const float* frags,
+                              const float* dVdx, int count, int stride,
+                              rgba* out)
+  {
+    static_cast<FS*>(fs)->FS::launch_batch(frags, dVdx, count, stride, out);
+  }
+};
+
+// GraphicPipeline for a fixed pair of shaders and vertex layout.
+// Everything else (attributes, uniforms, rasterization modes) works
+// just like GraphicPipeline, but there is no virtual dispatch and the
+// vbuffer element size is a constant, so the per-element loops of the
+// rasterizers are unrolled by the compiler.
+template<class VS, class FS, class Layout>
+class SpecializedPipeline : public GraphicPipeline
+{
+private:
+  typedef StaticShading<VS, FS, Layout> Shading;
+
+public:
+  void set_vertex_shader(VS& vshader) { GraphicPipeline::set_vertex_shader(vshader); }
+  void set_fragment_shader(FS& fshader) { GraphicPipeline::set_fragment_shader(fshader); }
+
+  // the vertex size is given by Layout
+  void upload_data(const std::vector<float>& data)
+  {
+    GraphicPipeline::upload_data(data, Layout::VERTEX_SIZE);
+  }
+
+  void upload_data(const std::vector<float>& data, const std::vector<int>& indices)
+  {
+    GraphicPipeline::upload_data(data, Layout::VERTEX_SIZE, indices);
+  }
+
+  void upload_data(const float* data, int n_floats,
+                    const int* indices = nullptr, int n_indices = 0)
+  {
+    GraphicPipeline::upload_data(data, n_floats, Layout::VERTEX_SIZE,
+                                  indices, n_indices);
+  }
+
+  void upload_data(const VertexBufferRef& buffer)
+  {
+    if(buffer->vertex_size != Layout::VERTEX_SIZE)
+    {
+      printf("ERROR: vertex size %d doesn't match the pipeline layout (%d)\n",
+              buffer->vertex_size, Layout::VERTEX_SIZE);
+      return;
+    }
+
+    GraphicPipeline::upload_data(buffer);
+  }
+
+  void render(Framebuffer& target, bool zbuffer = true,
+                                    bool culling = true,
+                                    bool cull_back = true,
+                                    bool fill = true,
+                                    PipelineStats* stats = nullptr)
+  {
+    run_pipeline<Shading>(target, zbuffer, culling, cull_back, fill, stats);
+  }
+};
+
+#endif
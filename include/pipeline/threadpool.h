@@ -0,0 +1,57 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// A minimal fork-join pool. Workers are created once and
+// sleep between jobs, so we don't pay thread creation on
+// every frame. A job is a set of n_tasks independent tasks
+// which workers grab dynamically (tiles have very different
+// costs, so static partitioning balances poorly); run()
+// blocks until all of them are done. The calling thread
+// also works, always with thread id 0, so a pool of size 1
+// has no workers at all and runs everything inline.
+class ThreadPool
+{
+private:
+  std::vector<std::thread> workers;
+
+  std::mutex lock;
+  std::condition_variable job_ready, job_done;
+
+  // the current job. generation is bumped every time a new
+  // job is published so sleeping workers can tell it apart
+  // from the previous one.
+  const std::function<void(int,int)> *job;
+  int n_tasks;
+  std::atomic<int> next_task;
+  int busy_workers;
+  unsigned int generation;
+  bool quit;
+
+  // SEEN is the generation of the last job run before
+  // the worker started, which it must not run
+  void worker_loop(int thread_id, unsigned int seen);
+  void work(int thread_id);
+  void stop_workers();
+
+public:
+  ThreadPool();
+  ~ThreadPool();
+
+  // n_threads <= 0 means one thread per hardware core
+  void resize(int n_threads);
+  int size() const;
+
+  // invokes job(task, thread_id) for every task in [0, n_tasks).
+  // thread_id is in [0, size()) and can be used to index
+  // per-thread scratch memory.
+  void run(int n_tasks, const std::function<void(int,int)>& job);
+};
+
+#endif
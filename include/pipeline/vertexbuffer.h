@@ -0,0 +1,20 @@
+#ifndef VERTEX_BUFFER_H
+#define VERTEX_BUFFER_H
+
+#include <vector>
+#include <memory>
+
+// Immutable vertex data, and optionally the indices of its
+// triangles (empty for triangle soups), which many pipelines
+// can render from without copying it. Pipelines hold a
+// reference to it, so it lives for as long as someone uses it.
+struct VertexBuffer
+{
+  std::vector<float> data;
+  int vertex_size;
+  std::vector<int> indices;
+};
+
+typedef std::shared_ptr<const VertexBuffer> VertexBufferRef;
+
+#endif
@@ -16,6 +16,20 @@ protected:
   // time spent in VertexShader (and FragmentShader as well)
   // is performing comparisons, which is due to map's binary
   // search.
+  // So now uniforms and attributes live in slots: shaders
+  // should resolve the names they use into slots once, in
+  // resolve_slots(), and use the slot-based getters in launch().
+  // The name-based getters are kept for convenience.
+  inline const float* get_uniform(int slot)
+  {
+    return &uniform_data[(*uniforms)[slot].stride];
+  }
+
+  inline const float* get_attribute(int slot, const float* vbuffer)
+  {
+    return &vbuffer[(*attribs)[slot].stride];
+  }
+
   inline const float* get_uniform(const std::string& name)
   {
     int stride = (*uniforms)[name].stride;
@@ -29,20 +43,68 @@ protected:
     return &vbuffer[stride];
   }
 
+  inline int uniform_slot(const std::string& name) { return uniforms->slot(name); }
+  inline int attribute_slot(const std::string& name) { return attribs->slot(name); }
+
+  // uniform_version(slot) changes every time the value of the
+  // uniform in slot changes (it is 0 if it was never uploaded),
+  // so derived values (like proj * view) can be computed once
+  // and kept until one of the uniforms they use changes.
+  inline unsigned int uniform_version(int slot) const
+  {
+    return slot < (int)uniform_versions->size() ? (*uniform_versions)[slot] : 0;
+  }
+
   //TODO: implement these functions to ease shader writing
   //forward(string& name, vbuffer)
   //forward(string& name, const float* val, vbuffer)
 
+  // slots used by the standard vertex shader
+  int view_id, proj_id, model_id;
+  int pos_id, normal_id;
+
+  // uniform-only values of the standard vertex shader, computed
+  // by prepare(): the model matrix, proj * view and the normal
+  // matrix (inverse transpose of model), for shaders that
+  // transform normals. prepared_for/prepared_version identify
+  // the uniform values they were computed from.
+  mat4 model, view_proj, normal_matrix;
+  const std::vector<unsigned int> *prepared_for;
+  unsigned int prepared_version;
+
 public:
+  VertexShader() : prepared_for(nullptr), prepared_version(0) {}
+
   virtual void launch(const float* vertex_in, float* vertex_out,
                       int vertex_sz, vec4& position);
 
+  // shades count vertices at once. The input of vertex i starts at
+  // vertex_in[i*in_stride] and its output at vertex_out[i*out_stride],
+  // where the first 4 floats receive the position and the attributes
+  // come right after it (i.e., launch() writes to vertex_out+4).
+  // The pipeline always calls this one; by default it calls launch()
+  // for each vertex.
+  virtual void launch_batch(const float* vertex_in, float* vertex_out,
+                            int count, int in_stride, int out_stride);
+
+  // invoked by the pipeline once attribs/uniforms are set
+  virtual void resolve_slots();
+
+  // invoked by the pipeline at the beginning of every render()
+  // call, before any vertex is shaded, and from a single thread.
+  // Anything depending only on uniforms (which are the same for
+  // all vertices) should be computed here instead of in launch().
+  // The default one computes the standard matrices, and does
+  // nothing unless "model", "view" and "proj" were all uploaded.
+  virtual void prepare();
+
   // vertex attributes positions/strides
-  std::map<std::string, Attribute> *attribs;
+  AttributeTable *attribs;
 
   // uniform memory
   const float *uniform_data;
-  std::map<std::string, Attribute> *uniforms;
+  AttributeTable *uniforms;
+  const std::vector<unsigned int> *uniform_versions;
 };
 
 #endif
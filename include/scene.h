@@ -0,0 +1,42 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+// Scene setup shared by the interactive viewer (app.h) and the
+// headless renderer. Nothing in here depends on nanogui or GL.
+#include "pipeline/pipeline.h"
+#include "pipeline/specializedpipeline.h"
+#include "mesh.h"
+
+#include "../shaders/octreebuilder.h"
+#include "../shaders/passthrough.h"
+#include "../shaders/standard.h"
+#include "../shaders/raymarcher.h"
+#include "../shaders/AO.h"
+
+// our shader pairs. Meshes are uploaded as position + normal,
+// while voxel raytracing renders a 2D quad
+typedef SpecializedPipeline<StandardShader, OctreeBuilderShader,
+                            VertexLayout<6> > VoxelizerPipeline;
+typedef SpecializedPipeline<StandardShader, AmbientOcclusionShader,
+                            VertexLayout<6> > AOPipeline;
+typedef SpecializedPipeline<PassthroughShader, RayMarcherShader,
+                            VertexLayout<2> > RayMarcherPipeline;
+
+// resolution of the voxelization passes
+const int GRID_RES = 512;
+
+// packs the (deduplicated) vertices of mesh as position + normal,
+// along with its index buffer. The result can be uploaded to any
+// number of pipelines.
+VertexBufferRef mesh_vertex_buffer(const Mesh& mesh);
+
+// voxelizes mesh (transformed by model) into OctreeBuilderShader::tree
+// by rendering it with an orthographic camera along the three axes.
+// gp must have the mesh uploaded already, with "pos" and "normal"
+// defined; target is used as scratch render target. If debug_prefix
+// is not null, the three views are saved as <debug_prefix>XY.png, etc.
+void build_octree(VoxelizerPipeline& gp, Framebuffer& target,
+                  const Mesh& mesh, const mat4& model,
+                  const char* debug_prefix = nullptr);
+
+#endif
@@ -1,33 +1,63 @@
 #include "AO.h"
+#include <cstdint>
+#include <cstring>
+
+// stateless random numbers: the rays of a fragment only depend on
+// its position, not on which thread shades it or in which order.
+// (lowbias32 integer hash by Chris Wellons)
+static inline uint32_t hash(uint32_t x)
+{
+  x ^= x >> 16; x *= 0x7feb352du;
+  x ^= x >> 15; x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+static inline uint32_t float_bits(float f)
+{
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+// uniform in [-1, 1)
+static inline float signed_unit(uint32_t seed, uint32_t k)
+{
+  return (hash(seed + k) >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+void AmbientOcclusionShader::resolve_slots()
+{
+  normal_id = attribute_slot("normal");
+  pos_id = attribute_slot("pos");
+}
 
 rgba AmbientOcclusionShader::launch(const float* vertex_in, const float* dVdx, int n)
 {
-  vec3 N( get_attribute("normal", vertex_in) );
-  vec3 P( get_attribute("pos", vertex_in) );
+  vec3 N( get_attribute(normal_id, vertex_in) );
+  vec3 P( get_attribute(pos_id, vertex_in) );
 
   const int n_rays = 15;
   float occlusion_f = 0.0f;
 
+  // only occluders closer than this count. rays start a few
+  // leaves away from P, as the leaves around it are the very
+  // surface P is on
+  const float max_dist = 0.1f;
+  const float min_dist = 3.0f * tree.leaf_size();
+
   // trace at least one ray in the Normal direction
-  float d = tree.closest_leaf(P, N);
-  if( !(d != d || d > 0.1f) ) occlusion_f += 1.0f;
+  if( tree.occluded(P, N, max_dist, min_dist) ) occlusion_f += 1.0f;
 
-  /*
-  if( d != d )
-    return rgba(0.0f, 1.0f, 0.0f, 1.0f);
-  else if( d == INFINITY )
-    return rgba(1.0f, 0.0f, 0.0f, 1.0f);
-  else
-    return rgba(0.0f, 0.0f, 1.0f, 1.0f);
-    */
 
+  const uint32_t seed = hash(float_bits(P(0)) ^
+                        hash(float_bits(P(1)) ^ hash(float_bits(P(2)))));
 
   for(int i = 1; i < n_rays; ++i)
   {
-    const float inv_max_rand = 1.0f / RAND_MAX;
-    float x = 2.0f*(rand()*inv_max_rand-0.5f);
-    float y = 2.0f*(rand()*inv_max_rand-0.5f);
-    float z = 2.0f*(rand()*inv_max_rand-0.5f);
+    float x = signed_unit(seed, 3*i+0);
+    float y = signed_unit(seed, 3*i+1);
+    float z = signed_unit(seed, 3*i+2);
 
     vec3 D = vec3(x,y,z).unit();
     float cosDN = D.dot(N);
@@ -37,8 +67,7 @@ rgba AmbientOcclusionShader::launch(const float* vertex_in, const float* dVdx, i
       cosDN = -cosDN;
     }
 
-    float d = tree.closest_leaf(P, D);
-    if(d != d || d > 0.1f) continue;
+    if( !tree.occluded(P, D, max_dist, min_dist) ) continue;
 
     occlusion_f += 1.0f * cosDN;
   }
@@ -60,3 +89,12 @@ rgba AmbientOcclusionShader::launch(const float* vertex_in, const float* dVdx, i
 
   return rgba(out, 1.0f);
 }
+
+void AmbientOcclusionShader::launch_batch(const float* vertex_in, const float* dVdx,
+                                          int count, int stride, rgba* out)
+{
+  // qualified call: no virtual dispatch per fragment
+  for(int i = 0; i < count; ++i)
+    out[i] = AmbientOcclusionShader::launch(&vertex_in[i*stride],
+                                            &dVdx[i*stride], stride);
+}
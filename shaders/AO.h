@@ -8,6 +8,7 @@ class AmbientOcclusionShader : public FragmentShader
 {
 private:
   const Octree &tree;
+  int normal_id, pos_id;
 
   const float EPS = 0.000001f;
   inline bool is_zero(float a) { return std::fabs(a) < EPS; }
@@ -15,6 +16,9 @@ private:
 public:
   AmbientOcclusionShader(const Octree& tree) : tree(tree) {}
   rgba launch(const float* vertex_in, const float* dVdx, int n) override;
+  void launch_batch(const float* vertex_in, const float* dVdx,
+                    int count, int stride, rgba* out) override;
+  void resolve_slots() override;
 };
 
 #endif
@@ -0,0 +1,40 @@
+#ifndef NORMAL_SHADER_H
+#define NORMAL_SHADER_H
+
+#include "../include/pipeline/fragmentshader.h"
+
+// Colors fragments by their (interpolated) normal. Almost
+// free, so it's useful to measure the cost of everything
+// else in the pipeline.
+class NormalShader : public FragmentShader
+{
+private:
+  int normal_id;
+
+public:
+  void resolve_slots() override
+  {
+    normal_id = attribute_slot("normal");
+  }
+
+  rgba launch(const float* vertex_in, const float* dVdx, int n) override
+  {
+    vec3 N( get_attribute(normal_id, vertex_in) );
+    N = N.unit();
+
+    return rgba((N(0)+1.0f)*0.5f,
+                (N(1)+1.0f)*0.5f,
+                (N(2)+1.0f)*0.5f,
+                1.0f);
+  }
+
+  void launch_batch(const float* vertex_in, const float* dVdx,
+                    int count, int stride, rgba* out) override
+  {
+    for(int i = 0; i < count; ++i)
+      out[i] = NormalShader::launch(&vertex_in[i*stride],
+                                    &dVdx[i*stride], stride);
+  }
+};
+
+#endif
@@ -1,41 +1,283 @@
 #include "octree.h"
 #include <cstdio>
+#include <cmath>
 #include <algorithm>
-#include <stack>
+#include <cfloat>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 // -----------------------------
 // --------- INTERNAL ----------
 // -----------------------------
-static bool intersect_box(const vec3& o, const vec3& d,
-                          const vec3& min, const vec3& max,
-                          float& tmin, float& tmax)
+// node bounds are plain float arrays: this runs for every
+// level of every descent, and vec3's accessors are not inlined.
+// returns the octant P falls in and shrinks [min, max] to it.
+// the splitting point is always the middle of the node
+static inline unsigned char descend(const float* p, float* min, float* max)
 {
-  #define EPS 0.00001f
+  unsigned char address = 0x0;
+  for(int i = 0; i < 3; ++i)
+  {
+    float split = (min[i] + max[i]) * 0.5f;
+    if( p[i] >= split )
+    {
+      address |= 0b100 >> i;
+      min[i] = split;
+    }
+    else max[i] = split;
+  }
+  return address;
+}
+
+// what traversals keep of a child: its index in Octree::svo
+// or, as leaves and empty octants have no node, one of these
+const int32_t SVO_EMPTY = -1;
+const int32_t SVO_LEAF = -2;
+
+static inline int32_t svo_child(const SVONode& n, int oct)
+{
+  if( !(n.valid & (1 << oct)) ) return SVO_EMPTY;
+  if( n.leaf & (1 << oct) ) return SVO_LEAF;
+  return (int32_t)n.child(oct);
+}
+
+// a node on the stack of the parametric traversal: the t's at
+// which the ray crosses its slabs and their midpoints, and its
+// integer coordinates among the nodes of its level. Children
+// are visited in increasing order of their (mirrored) address,
+// and OCT is the next one to visit; past 7, we're done here.
+struct TraversalFrame
+{
+  int32_t node;
+  float t0[3], t1[3], tm[3];
+  int x, y, z;
+  int oct;
+};
+
+// the node being entered: compute its midpoints and the first
+// child the ray goes through. Its entry slab is the latest one,
+// and the ray has already crossed the midplanes of the other
+// two axes if they come before that.
+static inline void enter_node(TraversalFrame& f, const float* t0, const float* t1)
+{
+  float entry = -FLT_MAX;
+  for(int i = 0; i < 3; ++i)
+  {
+    f.t0[i] = t0[i]; f.t1[i] = t1[i];
+    f.tm[i] = (t0[i] + t1[i]) * 0.5f;
+    entry = std::max(entry, t0[i]);
+  }
+
+  f.oct = 0;
+  for(int i = 0; i < 3; ++i)
+    if( f.tm[i] < entry ) f.oct |= 0b100 >> i;
+}
+
+// slab test of the box [min, max] against the 8 rays of a packet,
+// given their inverse directions. ENTRY gets the t at which each ray
+// enters the box; the result has bit i set if ray i goes through it
+// in front of its origin and before BEST[i].
+static inline unsigned int packet_slabs(const RayPacket8& rays, const float inv[3][8],
+                                        const float* min, const float* max,
+                                        const float* best, float* entry)
+{
+#if defined(__AVX__)
+  __m256 t_near = _mm256_set1_ps(-FLT_MAX), t_far = _mm256_set1_ps(FLT_MAX);
+  for(int i = 0; i < 3; ++i)
+  {
+    __m256 o = _mm256_loadu_ps(rays.o[i]), v = _mm256_loadu_ps(inv[i]);
+    __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min[i]), o), v);
+    __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max[i]), o), v);
+    t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+    t_far = _mm256_min_ps(t_far, _mm256_max_ps(t0, t1));
+  }
+  _mm256_storeu_ps(entry, t_near);
+
+  __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ),
+                             _mm256_cmp_ps(t_far, _mm256_setzero_ps(), _CMP_GE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(t_near, _mm256_loadu_ps(best), _CMP_LT_OQ));
+  return (unsigned int)_mm256_movemask_ps(hit);
+#elif defined(__SSE2__)
+  unsigned int mask = 0;
+  for(int h = 0; h < 2; ++h)
+  {
+    __m128 t_near = _mm_set1_ps(-FLT_MAX), t_far = _mm_set1_ps(FLT_MAX);
+    for(int i = 0; i < 3; ++i)
+    {
+      __m128 o = _mm_loadu_ps(&rays.o[i][4*h]), v = _mm_loadu_ps(&inv[i][4*h]);
+      __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[i]), o), v);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[i]), o), v);
+      t_near = _mm_max_ps(t_near, _mm_min_ps(t0, t1));
+      t_far = _mm_min_ps(t_far, _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(&entry[4*h], t_near);
+
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(t_near, t_far),
+                            _mm_cmpge_ps(t_far, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(t_near, _mm_loadu_ps(&best[4*h])));
+    mask |= (unsigned int)_mm_movemask_ps(hit) << (4*h);
+  }
+  return mask;
+#else
+  unsigned int mask = 0;
+  for(int j = 0; j < 8; ++j)
+  {
+    float t_near = -FLT_MAX, t_far = FLT_MAX;
+    for(int i = 0; i < 3; ++i)
+    {
+      float t0 = (min[i] - rays.o[i][j]) * inv[i][j];
+      float t1 = (max[i] - rays.o[i][j]) * inv[i][j];
+      t_near = std::max(t_near, std::min(t0, t1));
+      t_far = std::min(t_far, std::max(t0, t1));
+    }
+    entry[j] = t_near;
 
-  //use tavianator's slab method: sucessively clip ray in each axis
-  tmin = -FLT_MAX; tmax = FLT_MAX;
+    if( t_near <= t_far && t_far >= 0.0f && t_near < best[j] )
+      mask |= 1 << j;
+  }
+  return mask;
+#endif
+}
 
+// parametric traversal (Revelles et al., "An Efficient Parametric
+// Algorithm for Octree Traversal"). Every node is described by the
+// t's at which the ray crosses its 3 pairs of slabs, and the t's of
+// its children are those of the parent and the midpoints between
+// them, so there's one division per axis for the whole traversal.
+// children are visited front to back: the first alive leaf found is
+// the closest one.
+//
+// the ray is mirrored so that all components of d are positive, which
+// makes the traversal order the same in all axes; A is the mask to
+// go from a child in mirrored space to the actual one.
+//
+// this computes A and the t's of the box [b_min, b_max]. Returns
+// false if the ray misses the box (or has NaNs/INFs)
+static bool parametric_setup(const float* o_, const float* d_,
+                             const float* b_min, const float* b_max,
+                             float* t0, float* t1, unsigned char& a)
+{
+  a = 0;
   for(int i = 0; i < 3; ++i)
   {
-    //if r.d(i) == 0, ray is parallel to the current axis
-    if(d(i) == 0.0f ) continue;
+    // NaNs would make every comparison below false
+    if( !std::isfinite(o_[i]) || !std::isfinite(d_[i]) ) return false;
 
-    float t1, t2, ro = o(i);
+    float oi = o_[i], di = d_[i];
+    if( di < 0.0f )
+    {
+      oi = b_min[i] + b_max[i] - oi;
+      di = -di;
+      a |= 0b100 >> i;
+    }
 
-    //this should avoid the cases where the ray intersects infinitely
-    //many points on one of the planes
-    if( min(i) == o(i) || max(i) == o(i)) ro += EPS;
+    // rays parallel to an axis. a tiny positive direction keeps
+    // the t's finite, so we never compute 0 * INF or INF - INF
+    if( di < 1e-20f ) di = 1e-20f;
+
+    float inv = 1.0f / di;
+    t0[i] = (b_min[i] - oi) * inv;
+    t1[i] = (b_max[i] - oi) * inv;
+  }
 
-    t1 = (min(i) - ro) / d(i);
-    t2 = (max(i) - ro) / d(i);
+  // ray misses the outter bounding box
+  return std::max(t0[0], std::max(t0[1], t0[2])) < std::min(t1[0], std::min(t1[1], t1[2]));
+}
+
+// walks the subtree of the svo node ROOT, given the t's of its
+// slabs and its integer coordinates among the nodes of its level.
+// HIT is only filled if not null.
+static bool parametric_walk(const std::vector<SVONode>& svo, unsigned char a,
+                            float tmin, float tmax, int32_t root,
+                            const float* t0, const float* t1,
+                            const int* xyz, OctreeHit* hit)
+{
+  // one frame per internal level
+  TraversalFrame stack[MAX_DEPTH];
+  int top = 0;
+  TraversalFrame *f = &stack[0];
+  f->node = root;
+  f->x = xyz[0]; f->y = xyz[1]; f->z = xyz[2];
+  enter_node(*f, t0, t1);
+
+  while( top >= 0 )
+  {
+    f = &stack[top];
+
+    // no more children to visit in this node
+    if( f->oct > 7 )
+    {
+      top--;
+      continue;
+    }
 
-    tmin = std::fmax(tmin, std::fmin(t1, t2));
-    tmax = std::fmin(tmax, std::fmax(t1, t2));
+    // interval of the current child
+    int oct = f->oct;
+    float c0[3], c1[3];
+    for(int i = 0; i < 3; ++i)
+    {
+      bool upper = oct & (0b100 >> i);
+      c0[i] = upper ? f->tm[i] : f->t0[i];
+      c1[i] = upper ? f->t1[i] : f->tm[i];
+    }
+
+    // the next child is the neighbor across the first slab
+    // the ray exits this one through. If we're already on
+    // the upper half of that axis, we leave the node
+    int exit_axis = 0;
+    if( c1[1] < c1[exit_axis] ) exit_axis = 1;
+    if( c1[2] < c1[exit_axis] ) exit_axis = 2;
+    unsigned char exit_bit = 0b100 >> exit_axis;
+    f->oct = (oct & exit_bit) ? 8 : (oct | exit_bit);
+
+    int entry_axis = 0;
+    if( c0[1] > c0[entry_axis] ) entry_axis = 1;
+    if( c0[2] > c0[entry_axis] ) entry_axis = 2;
+    float t_entry = c0[entry_axis];
+    float t_exit = c1[exit_axis];
+
+    // children are visited front to back, so if
+    // this one is too far all the others are too
+    if( t_entry > tmax ) return false;
+
+    // entirely behind the origin (or tmin)
+    if( t_exit < tmin ) continue;
+
+    int32_t next = svo_child(svo[f->node], oct ^ a);
+    if( next == SVO_EMPTY ) continue;
+
+    int real = oct ^ a;
+    int x = f->x*2 + ((real >> 2) & 1);
+    int y = f->y*2 + ((real >> 1) & 1);
+    int z = f->z*2 + (real & 1);
+
+    if( next == SVO_LEAF )
+    {
+      // leaves the ray starts in (its entry is not strictly
+      // after tmin) are not hits: that's a self intersection
+      if( t_entry <= tmin ) continue;
+
+      if( !hit ) return true;
+
+      float n[] = {0.0f, 0.0f, 0.0f};
+      n[entry_axis] = (a & (0b100 >> entry_axis)) ? 1.0f : -1.0f;
+
+      hit->t = t_entry;
+      hit->normal = vec3(n[0], n[1], n[2]);
+      hit->voxel[0] = x; hit->voxel[1] = y; hit->voxel[2] = z;
+      return true;
+    }
+
+    // descend
+    TraversalFrame *child = &stack[++top];
+    child->node = next;
+    child->x = x; child->y = y; child->z = z;
+    enter_node(*child, c0, c1);
   }
 
-  //tmax = tmin is a hit right in the corner of the box,
-  //which we assume to not to be a hit! TODO: is this a problem?
-  return tmax >= tmin && tmax > 0.0f;
+  return false;
 }
 
 // ----------------------------------
@@ -45,378 +287,260 @@ static bool intersect_box(const vec3& o, const vec3& d,
 // -------------------------
 // --------- Node ----------
 // -------------------------
-Node::Node() : min_x(0.0f), min_y(0.0f), min_z(0.0f),
-               max_x(0.0f), max_y(0.0f), max_z(0.0f)
+Node::Node()
 {
-  // we just need to guarantee that the pointers
-  // are all null
+  // we just need to guarantee that there are no children
   for(int i = 0; i < 8; ++i)
-    Internal.children[i] = nullptr;
+    Internal.children[i] = 0;
 
   // AND that the node is not alive as of its creation
   // This part won't overlap the children nodes pointers.
   Leaf.alive = false;
 }
 
-Node::~Node()
+// ---------------------------
+// --------- Octree ----------
+// ---------------------------
+Octree::Octree() : bb_min(0.0f, 0.0f, 0.0f), bb_max(0.0f, 0.0f, 0.0f)
 {
-  //TODO: we should traverse the tree deleting stuff
+  nodes.push_back(Node());
+  svo.push_back(SVONode());
 }
 
-unsigned char Node::which_child(const vec3& p) const
+void Octree::clear()
 {
-  unsigned char address = 0x0;
-  if( p(0) >= this->Internal.x ) address |= 0b100;
-  if( p(1) >= this->Internal.y ) address |= 0b010;
-  if( p(2) >= this->Internal.z ) address |= 0b001;
-  return address;
+  // Node has no destructor, so this doesn't touch the nodes
+  // and the capacity is kept for the next build
+  nodes.clear();
+  nodes.push_back(Node());
+
+  // an empty root: rays miss everything until compact()
+  svo.clear();
+  svo.push_back(SVONode());
 }
 
-bool Node::inside_node(const vec3& p) const
+void Octree::set_aabb(const vec3& min, const vec3& max)
 {
-  bool inside_x = (min_x <= p(0)) && (p(0) <= max_x);
-  bool inside_y = (min_y <= p(1)) && (p(1) <= max_y);
-  bool inside_z = (min_z <= p(2)) && (p(2) <= max_z);
-  return inside_x && inside_y && inside_z;
+  // nodes are only meaningful inside the box they were built in
+  clear();
+  bb_min = min;
+  bb_max = max;
 }
 
-// ---------------------------
-// --------- Octree ----------
-// ---------------------------
-void Octree::set_aabb(const vec3& min, const vec3& max)
+bool Octree::closest_leaf(const vec3& o, const vec3& d, OctreeHit& hit,
+                          float tmin, float tmax) const
 {
-  root.min_x = min(0);
-  root.min_y = min(1);
-  root.min_z = min(2);
-  root.max_x = max(0);
-  root.max_y = max(1);
-  root.max_z = max(2);
-
-  vec3 center = (min + max) * 0.5f;
-  root.Internal.x = center(0);
-  root.Internal.y = center(1);
-  root.Internal.z = center(2);
+  const float o_[] = {o(0), o(1), o(2)};
+  const float d_[] = {d(0), d(1), d(2)};
+  const float b_min[] = {bb_min(0), bb_min(1), bb_min(2)};
+  const float b_max[] = {bb_max(0), bb_max(1), bb_max(2)};
+  const int xyz[] = {0, 0, 0};
+
+  float t0[3], t1[3];
+  unsigned char a;
+  if( !parametric_setup(o_, d_, b_min, b_max, t0, t1, a) ) return false;
+
+  return parametric_walk(svo, a, tmin, tmax, 0, t0, t1, xyz, &hit);
 }
 
-float Octree::closest_leaf(const vec3& o, const vec3& d) const
+bool Octree::occluded(const vec3& o, const vec3& d, float tmax, float tmin) const
 {
-  struct TraversalElem
+  const float o_[] = {o(0), o(1), o(2)};
+  const float d_[] = {d(0), d(1), d(2)};
+  float min[] = {bb_min(0), bb_min(1), bb_min(2)};
+  float max[] = {bb_max(0), bb_max(1), bb_max(2)};
+  int xyz[] = {0, 0, 0};
+
+  float t0[3], t1[3];
+  unsigned char a;
+  if( !parametric_setup(o_, d_, min, max, t0, t1, a) ) return false;
+
+  // short rays (like AO's) don't need to start at the root: go down
+  // to the deepest node containing the whole segment [tmin, tmax].
+  // If it has no leaves at all, there's nothing to traverse.
+  // (with an infinite tmax, the segment never fits in a child)
+  float p0[3], p1[3];
+  bool inside = tmax < INFINITY;
+  for(int i = 0; i < 3; ++i)
   {
-    const Node* n;
-    float tmin, tmax;
-    int depth;
+    p0[i] = o_[i] + d_[i]*tmin;
+    p1[i] = o_[i] + d_[i]*tmax;
+    inside = inside && min[i] <= std::min(p0[i], p1[i]) &&
+                       std::max(p0[i], p1[i]) <= max[i];
+  }
 
-    TraversalElem(const Node* n, float tmin, float tmax, int depth)
-      : n(n), tmin(tmin), tmax(tmax), depth(depth) { }
-  };
+  int32_t node = 0;
+  while( inside )
+  {
+    float min0[] = {min[0], min[1], min[2]}, max0[] = {max[0], max[1], max[2]};
+    float min1[] = {min[0], min[1], min[2]}, max1[] = {max[0], max[1], max[2]};
+    unsigned char oct = descend(p0, min0, max0);
+    if( descend(p1, min1, max1) != oct ) break;
 
-  // --------------------
-  vec3 bb_min = vec3(root.min_x, root.min_y, root.min_z);
-  vec3 bb_max = vec3(root.max_x, root.max_y, root.max_z);
+    int32_t next = svo_child(svo[node], oct);
 
-  // bail out if no intersection with the outter bounding box
-  float outter_tmin, outter_tmax;
-  if( !intersect_box(o, d, bb_min, bb_max, outter_tmin, outter_tmax) )
-    return NAN;
+    // empty space. if it's a leaf instead, the whole segment is in
+    // it, but leaves the ray starts in don't count anyway
+    if( next < 0 ) return false;
 
-  std::stack<TraversalElem> stack;
-  stack.push( TraversalElem(&root, outter_tmin, outter_tmax, 1) );
+    node = next;
+    for(int i = 0; i < 3; ++i)
+    {
+      min[i] = min0[i];
+      max[i] = max0[i];
+
+      // the child's t's come from the midpoints, as in the
+      // walk, so we end up with the very same t's it would
+      float tm = (t0[i] + t1[i]) * 0.5f;
+      if( (oct ^ a) & (0b100 >> i) ) t0[i] = tm;
+      else t1[i] = tm;
+    }
+    xyz[0] = xyz[0]*2 + ((oct >> 2) & 1);
+    xyz[1] = xyz[1]*2 + ((oct >> 1) & 1);
+    xyz[2] = xyz[2]*2 + (oct & 1);
+  }
 
+  return parametric_walk(svo, a, tmin, tmax, node, t0, t1, xyz, nullptr);
+}
 
-  bool EXITED = false;
+// packets can't use the parametric traversal, as each ray would
+// need its own t's. Instead, nodes carry their bounding box and are
+// slab tested against all rays, which is cheap with SIMD. A node is
+// visited if any ray still looking for a closer hit goes through it.
+// children are pushed so that they're popped in the front to back
+// order of the first ray; rays going in other directions still get
+// their closest hit, as every ray keeps its own best t.
+unsigned int Octree::closest_leaf_packet(const RayPacket8& rays, float* t, vec3* n) const
+{
+  float inv[3][8], best[8], entry[8];
+  unsigned char a = 0;
+  unsigned int alive = 0;
 
-  while( !stack.empty() )
+  for(int j = 0; j < 8; ++j)
   {
-    TraversalElem e = stack.top(); stack.pop();
-    float tmin = e.tmin, tmax = e.tmax;
-    const Node* node = e.n;
-    int depth = e.depth;
-
-    // skip if node is NULL. there's no leaf down here
-    if(!node)
+    bool finite = true;
+    for(int i = 0; i < 3; ++i)
     {
-      EXITED = true;
-      continue;
-    }
+      // same as in closest_leaf(): keep the t's finite
+      float di = rays.d[i][j];
+      if( std::fabs(di) < 1e-20f ) di = di < 0.0f ? -1e-20f : 1e-20f;
+      inv[i][j] = 1.0f / di;
 
-    // TODO: return actual intersection point and normal
-    // so we can perform some basic shading.
-    // This is always the closest leaf (alive or not) intersected
-    // by the ray in this point of the traversal!
-    // We need to check whether this leaf is alive not to return
-    // intersections with empty leaves that might exist. Also, if its
-    // alive, we need to check whether the origin of the ray is inside
-    // this leaf to avoid self-intersections: if the origin is inside
-    // this leaf, just keep searching for further alive leaves.
-    // If we found a leaf which is alive AND our intersection point
-    // is outside it, then we succedeed in finding the closest leaf!
-    if(depth == MAX_DEPTH)
-    {
-      //NOTE: Although this seems to be effective so to avoid intersection
-      //with neighboring leaves, it may not solve everything. what if we have
-      //the following situation?
-      //
-      // ------------------------------------------------
-      // __      |         |         |         |        |
-      //   o --> |         |         |         |        |
-      //    \____|_________|_________|_________|________|
-      //         |         |         |         |        |
-      //-------------------------------------------------
-      //
-      // When shooting a ray from o in the direction pointed by -->,
-      // not only the neighboring leaf will be alive and should be
-      // considered to occlude the ray, but all other voxels too.
-      // This is quite complicated, because rigourously speaking this
-      // is an intrinsic flaw of discretizing our space, but on the other
-      // hand we can "hotfix" it by forcing a ray to traverse at least
-      // a void voxel before considering any intersection to be valid.
-      //
-      // Is this a valid constraint? Surely is not a beautiful solution,
-      // but may solve two problems easily (self intersections and travelling
-      // inside voxel "tunnels" like that)
-      //
-      const float L_voxel = 3.0f/128.0f; //set this as parameter
-      const float over_L = 1.0f/L_voxel;
-
-      float pX = root.min_x + floor((o(0)-root.min_x)*over_L)*L_voxel;
-      float pY = root.min_y + floor((o(1)-root.min_y)*over_L)*L_voxel;
-      float pZ = root.min_z + floor((o(2)-root.min_z)*over_L)*L_voxel;
-
-      float d_l1 = std::fabs(pX-node->min_x) +
-                    std::fabs(pY-node->min_y) +
-                    std::fabs(pZ-node->min_z);
-
-      if( !node->Leaf.alive )
-      {
-        EXITED = true;
-        continue;
-      }
-
-      if(node->inside_node(o) || !EXITED || d_l1 <= L_voxel) continue;
-      else return tmin;
+      finite = finite && std::isfinite(rays.o[i][j]) && std::isfinite(rays.d[i][j]);
     }
 
-    // if we intersect the box, compute
-    // the (possibly) inner intersections
-    // TODO: Take care of INFs!
-    const float sx = node->Internal.x, sy = node->Internal.y, sz = node->Internal.z;
-    float tx = (sx - o(0)) / d(0);
-    float ty = (sy - o(1)) / d(1);
-    float tz = (sz - o(2)) / d(2);
-
-    // order intersections in decreasing order because
-    // we start from the furthest box to the closest one,
-    // which is the order we want to push them to the stack.
-    // we don't include tmax here because this
-    // is the intersection we'll be starting with.
-    float t[] = {tx, ty, tz, tmin};
-    std::sort(std::begin(t), std::end(t), [](float a, float b) {
-                                              return a > b;
-                                            });
-
-    // loop intersections in order, discarding
-    // points when they're before tmin or after
-    // tmax, computing the mid-points
-    // break when tlast = tmin
-    float mid[4]; float tlast = tmax;
-    int i = 0, mid_ind = 0;
-    while( tlast != tmin )
-    {
-      // if our last intersection point was at t = 0,
-      // just stop looking the next intersections (the
-      // t's are ordered, thus everyone from now on
-      // will be negative).
-      if(tlast == 0.0f) break;
-
-      //TODO: segfaulting here because i is too big
-      // when the origin of the ray is inside the octree
-      // itself, we'll have negative values of t because
-      // intersections may occur BEHIND the origin.
-      // In these cases we just clamp the value to zero, i.e.
-      // we traverse only the octants in front of the origin.
-      float cur = t[i];
-      if( cur < 0.0f ) cur = 0.0f;
-
-      // if our current intersection is BEHIND
-      // tlast, just skip this and get the next
-      if( cur >= tlast )
-      {
-        //TODO: probably because if there's any problem with
-        //all t's being infinity or nan, this will loop forever.
-        // We need to limit the amount of loops here so that i
-        // is never greater than 3! but I'm not sure right now
-        // what's the best way to do this.
-        i++;
-        continue;
-      }
+    // rays with NaNs/INFs never hit anything
+    best[j] = finite ? INFINITY : -INFINITY;
+    if( finite ) alive |= 1 << j;
+
+    t[j] = NAN;
+    n[j] = vec3(0.0f, 0.0f, 0.0f);
+  }
 
-      // intersection is correct; compute mid point
-      float mid_point = (tlast + cur) * 0.5f;
+  if( !alive ) return 0;
 
-      // compute in which octant the mid point falls
-      // and push to the stack
-      int oct = node->which_child(o + d*mid_point);
-      const Node* next = node->Internal.children[oct];
+  // order children for the first valid ray
+  int first = __builtin_ctz(alive);
+  for(int i = 0; i < 3; ++i)
+    if( rays.d[i][first] < 0.0f ) a |= 0b100 >> i;
 
-      TraversalElem next_e(next, cur, tlast, depth+1);
-      stack.push(next_e);
+  struct PacketElem
+  {
+    int32_t node;
+    float min[3], max[3];
+  };
 
-      // advance tlast to the next intersection
-      // so we can get the next octant being intersected
-      tlast = cur;
-      i++;
-    }
+  // at most 7 siblings wait on the stack for each level
+  PacketElem stack[8*MAX_DEPTH];
+  int top = 0;
+  stack[0].node = 0;
+  for(int i = 0; i < 3; ++i)
+  {
+    stack[0].min[i] = bb_min(i);
+    stack[0].max[i] = bb_max(i);
   }
 
-  // if we reached this point, no actual leaf was found
-  return NAN;
-}
+  unsigned int hits = 0;
 
-float Octree::closest_leaf(const vec3& o, const vec3& d, vec3& normal) const
-{
-  struct TraversalElem
+  while( top >= 0 )
   {
-    const Node* n;
-    float tmin, tmax;
-    vec3 normal;
-    int depth;
-
-    TraversalElem(const Node* n, float tmin, float tmax, int depth)
-      : n(n), tmin(tmin), tmax(tmax), depth(depth) { }
+    PacketElem e = stack[top--];
 
-    TraversalElem(const Node* n, float tmin, float tmax, const vec3& normal, int depth)
-        : n(n), tmin(tmin), tmax(tmax), depth(depth), normal(normal) { }
-  };
+    unsigned int mask = packet_slabs(rays, inv, e.min, e.max, best, entry);
+    if( !mask ) continue;
 
-  // --------------------
-  vec3 bb_min = vec3(root.min_x,
-                      root.min_y,
-                      root.min_z);
-  vec3 bb_max = vec3(root.max_x,
-                      root.max_y,
-                      root.max_z);
-
-  // bail out if no intersection with the outter bounding box
-  // TODO: not computing first intersection gives problems in the cube.obj
-  // scene!
-  float outter_tmin, outter_tmax;
-  if( !intersect_box(o, d, bb_min, bb_max, outter_tmin, outter_tmax) )
-    return NAN;
-
-  std::stack<TraversalElem> stack;
-  stack.push( TraversalElem(&root, outter_tmin, outter_tmax, 1) );
-
-  while( !stack.empty() )
-  {
-    TraversalElem e = stack.top(); stack.pop();
-    float tmin = e.tmin, tmax = e.tmax;
-    const Node* node = e.n;
-    int depth = e.depth;
-
-    // bail out if node is NAN. there's no leaf down here
-    if(!node) continue;
-
-    // this is the first leaf intersected by the ray!
-    // TODO: return actual intersection point and normal
-    // so we can perform some basic shading.
-    if(depth == MAX_DEPTH)
+    if( e.node == SVO_LEAF )
     {
-      if( !node->Leaf.alive || node->inside_node(o)) continue;
-      else
+      for(int j = 0; j < 8; ++j)
       {
-        normal = e.normal;
-        return tmin;
+        // as in closest_leaf(), leaves the ray starts in don't count
+        if( !(mask & (1 << j)) || entry[j] <= 0.0f ) continue;
+
+        // the slab the ray entered through
+        int axis = 0;
+        float t_axis = -FLT_MAX;
+        for(int i = 0; i < 3; ++i)
+        {
+          float ti = ((rays.d[i][j] < 0.0f ? e.max[i] : e.min[i]) - rays.o[i][j]) * inv[i][j];
+          if( ti > t_axis ) { t_axis = ti; axis = i; }
+        }
+
+        float nv[] = {0.0f, 0.0f, 0.0f};
+        nv[axis] = rays.d[axis][j] < 0.0f ? 1.0f : -1.0f;
+
+        best[j] = entry[j];
+        t[j] = entry[j];
+        n[j] = vec3(nv[0], nv[1], nv[2]);
+        hits |= 1 << j;
       }
+      continue;
     }
 
-    // if we intersect the box, compute
-    // the (possibly) inner intersections
-    // TODO: Take care of INFs!
-    const float sx = node->Internal.x, sy = node->Internal.y, sz = node->Internal.z;
-    float tx = (sx - o(0)) / d(0);
-    float ty = (sy - o(1)) / d(1);
-    float tz = (sz - o(2)) / d(2);
-
-    // order intersections in decreasing order because
-    // we start from the furthest box to the closest one,
-    // which is the order we want to push them to the stack.
-    // we don't include tmax here because this
-    // is the intersection we'll be starting with.
-    //TODO: problem with signs! need to decide whether intersects
-    //from the front or from behind
-    struct TNormal { float t; vec3 n; };
-    TNormal t[] = { TNormal{.t=tx, .n=vec3(1.0f, 0.0f, 0.0f)},
-                    TNormal{.t=ty, .n=vec3(0.0f, 1.0f, 0.0f)},
-                    TNormal{.t=tz, .n=vec3(0.0f, 0.0f, 1.0f)},
-                    TNormal{.t=tmin, .n=e.normal} };
-
-    std::sort(std::begin(t), std::end(t), [](const TNormal& a, const TNormal& b)
-                                            {
-                                              return a.t > b.t;
-                                            });
-
-    // loop intersections in order, discarding
-    // points when they're before tmin or after
-    // tmax, computing the mid-points
-    // break when tlast = tmin
-    float mid[4]; float tlast = tmax;
-    int i = 0, mid_ind = 0;
-    while( tlast != tmin )
+    // push the children back to front: ascending mirrored
+    // address is a front to back order for the first ray
+    const SVONode& node = svo[e.node];
+    for(int oct = 7; oct >= 0; --oct)
     {
-      if( tlast == 0.0f ) break;
-
-      //TODO: segfaulting here because i is too big
-      TNormal cur = t[i];
-      if(cur.t < 0.0f) cur.t = 0.0f;
+      int real = oct ^ a;
+      int32_t next = svo_child(node, real);
+      if( next == SVO_EMPTY ) continue;
 
-      // if our current intersection is BEHIND
-      // tlast, just skip this and get the next
-      if( cur.t >= tlast )
+      PacketElem &c = stack[++top];
+      c.node = next;
+      for(int i = 0; i < 3; ++i)
       {
-        //TODO: probably because if there's any problem with
-        // all t's being infinity or nan, this will loop forever.
-        // We need to limit the amount of loops here so that i
-        // is never greater than 3! but I'm not sure right now
-        // what's the best way to do this.
-        i++;
-        continue;
+        float split = (e.min[i] + e.max[i]) * 0.5f;
+        bool upper = real & (0b100 >> i);
+        c.min[i] = upper ? split : e.min[i];
+        c.max[i] = upper ? e.max[i] : split;
       }
-
-      // intersection is correct; compute mid point
-      float mid_point = (tlast + cur.t) * 0.5f;
-
-      // compute in which octant the mid point falls
-      // and push to the stack
-      int oct = node->which_child(o + d*mid_point);
-      const Node* next = node->Internal.children[oct];
-
-      TraversalElem next_e(next, cur.t, tlast, cur.n, depth+1);
-      stack.push(next_e);
-
-      // advance tlast to the next intersection
-      // so we can get the next octant being intersected
-      tlast = cur.t;
-      i++;
     }
   }
 
-  // if we reached this point, no actual leaf was found
-  return NAN;
+  return hits;
+}
+
+float Octree::leaf_size() const
+{
+  return (bb_max(0) - bb_min(0)) / (1 << (MAX_DEPTH-1));
 }
 
 bool Octree::is_inside(const vec3& p) const
 {
   //TODO: there are lots of repeated code here and in
   //add_point(). FUsion both!
-  const Node *n = &root;
-  float l = root.max_x - root.min_x;
+  const Node *n = &nodes[0];
+  float min[] = {bb_min(0), bb_min(1), bb_min(2)};
+  float max[] = {bb_max(0), bb_max(1), bb_max(2)};
+  const float p_[] = {p(0), p(1), p(2)};
+  float l = max[0] - min[0];
 
   // assert that P is inside the outter bounding box.
   // TODO: do the same for add_point()
   float half_l = l*0.5f;
-  if( fabs(p(0) - root.Internal.x) > half_l ||
-      fabs(p(1) - root.Internal.y) > half_l ||
-      fabs(p(2) - root.Internal.z) > half_l ) return false;
+  if( fabs(p_[0] - (min[0] + max[0]) * 0.5f) > half_l ||
+      fabs(p_[1] - (min[1] + max[1]) * 0.5f) > half_l ||
+      fabs(p_[2] - (min[2] + max[2]) * 0.5f) > half_l ) return false;
 
   // go down until we reach MAX_DEPTH (a leaf) or
   // a null node
@@ -426,10 +550,14 @@ bool Octree::is_inside(const vec3& p) const
     // on the voxel structure. bail out!
     if( !n ) return false;
 
+    // leaves have no children to look at
+    if( i == MAX_DEPTH-1 ) break;
+
     // decide in which octant this point falls
     // and try to descend
-    unsigned char oct = n->which_child(p);
-    n = n->Internal.children[oct];
+    unsigned char oct = descend(p_, min, max);
+    uint32_t child = n->Internal.children[oct];
+    n = child ? &nodes[child] : nullptr;
   }
 
   // if we reached this point, we reached a leaf
@@ -438,44 +566,90 @@ bool Octree::is_inside(const vec3& p) const
   return true;
 }
 
+void Octree::compact()
+{
+  svo.clear();
+  svo.push_back(SVONode());
+
+  // octree node each svo node comes from
+  std::vector<uint32_t> src(1, 0);
+
+  // breadth first, one level at a time, so that the children of a
+  // node are appended one after the other. [begin, end) is the level
+  // we're visiting, whose children are appended to the end of svo
+  size_t begin = 0, end = 1;
+  for(int depth = 1; depth < MAX_DEPTH; ++depth)
+  {
+    // below this level there are only leaves
+    bool leaves = depth == MAX_DEPTH-1;
+
+    for(size_t i = begin; i < end; ++i)
+    {
+      const Node& n = nodes[src[i]];
+      uint32_t first = (uint32_t)svo.size();
+      uint8_t valid = 0, leaf = 0;
+
+      for(int oct = 0; oct < 8; ++oct)
+      {
+        uint32_t child = n.Internal.children[oct];
+        if( !child ) continue;
+
+        if( leaves )
+        {
+          // dead leaves are just empty space
+          if( !nodes[child].Leaf.alive ) continue;
+          leaf |= 1 << oct;
+        }
+        else
+        {
+          svo.push_back(SVONode());
+          src.push_back(child);
+        }
+
+        valid |= 1 << oct;
+      }
+
+      svo[i].first_child = first;
+      svo[i].valid = valid;
+      svo[i].leaf = leaf;
+    }
+
+    begin = end;
+    end = svo.size();
+  }
+}
+
 void Octree::add_point(const vec3& p)
 {
-  Node *n = &root;
+  // indices, not pointers: creating a node may
+  // reallocate the node array
+  uint32_t n = 0;
+  float min[] = {bb_min(0), bb_min(1), bb_min(2)};
+  float max[] = {bb_max(0), bb_max(1), bb_max(2)};
+  const float p_[] = {p(0), p(1), p(2)};
 
   // go down until the last but one level,
   // which are internal nodes only
   for(int i = 0; i < MAX_DEPTH-1; ++i)
   {
     // decide in which octant this point falls
-    unsigned char address = n->which_child(p);
-    Node **next = &n->Internal.children[address];
+    unsigned char address = descend(p_, min, max);
+    uint32_t next = nodes[n].Internal.children[address];
 
     // if this node hasn't been created yet, do it
-    if( !(*next) )
+    if( !next )
     {
-      *next = new Node;
-
-      // compute bounding box for the new node.
-      (*next)->min_x = address & 0b100 ? n->Internal.x : n->min_x;
-      (*next)->min_y = address & 0b010 ? n->Internal.y : n->min_y;
-      (*next)->min_z = address & 0b001 ? n->Internal.z : n->min_z;
-
-      (*next)->max_x = ~address & 0b100 ? n->Internal.x : n->max_x;
-      (*next)->max_y = ~address & 0b010 ? n->Internal.y : n->max_y;
-      (*next)->max_z = ~address & 0b001 ? n->Internal.z : n->max_z;
-
-      // compute splitting point (midpoint)
-      (*next)->Internal.x = ( (*next)->min_x + (*next)->max_x ) * 0.5f;
-      (*next)->Internal.y = ( (*next)->min_y + (*next)->max_y ) * 0.5f;
-      (*next)->Internal.z = ( (*next)->min_z + (*next)->max_z ) * 0.5f;
+      next = (uint32_t)nodes.size();
+      nodes.push_back(Node());
+      nodes[n].Internal.children[address] = next;
     }
 
     // descend tree
-    n = *next;
+    n = next;
   }
 
   // at this point, all nodes (including the leaf itself)
   // we created and n now points to the leaf. Mark it as
   // ALIVE.
-  n->Leaf.alive = true;
+  nodes[n].Leaf.alive = true;
 }
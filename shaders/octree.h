@@ -1,34 +1,31 @@
 #ifndef OCTREE_H
 #define OCTREE_H
 
+#include <cmath>
+#include <cstdint>
+#include <vector>
 #include "../include/matrix.h"
 
-// in order to build a compact octree, nodes should
-// allocated on demand once we request a fragment to be
-// inserted into the tree. nodes should be allocated
-// sequentially if possible so that memory jumps are not
-// huge. as described in the original article, leaves store
-// a pointer to attributes in texture memory, but we won't
-// make any distinction here. in the end, this is just a
-// basic octree, far from the sparse voxel tree devised in
-// the article.
+// the tree is built in two steps. voxelization inserts points
+// into a plain octree (Node), whose nodes are allocated on demand
+// and sequentially, so that memory jumps are not huge. once all
+// points are in, compact() turns it into the sparse voxel tree
+// devised in the article (SVONode), which is what rays traverse.
+// as described in the article, leaves should store a pointer to
+// attributes in texture memory, but ours are just alive or not.
 const int MAX_DEPTH = 9;
 
+// nodes don't store their bounding box nor their splitting
+// point: both are derived from the outter bounding box and
+// the path from the root, i.e. from the depth and position of
+// the node, while we descend the tree. children are indices
+// into Octree::nodes instead of pointers, so a node is 32 bytes.
 struct Node
 {
-  // bounding box
-  float min_x, min_y, min_z;
-  float max_x, max_y, max_z;
-
   union
   {
     struct
     {
-      // splitting point of this node.
-      // we can't store a vec3, so we do
-      // this explicitly as 3 floats.
-      float x, y, z;
-
       //Nodes are ordered as follows:
       //
       // l b f
@@ -42,7 +39,9 @@ struct Node
       //
       // So that address 7 = 0b111 is on the
       // upper-, right-, back- octant.
-      Node* children[8];
+      // 0 means there's no child: that's the root's index
+      // and the root is nobody's child.
+      uint32_t children[8];
     } Internal;
 
     struct
@@ -53,25 +52,119 @@ struct Node
     } Leaf;
   };
 
-  //QUESTION: Inline?
-  unsigned char which_child(const vec3& p) const;
-  bool inside_node(const vec3& p) const;
-
   Node();
-  ~Node();
+};
+
+// the sparse voxel octree of the article, which is what rays
+// traverse: Octree::nodes is good for inserting points, but each
+// node spends 32 bytes on 8 child indices, most of them empty.
+// Here the children of a node are stored contiguously, so a node
+// only needs the index of its first child and two masks: bit i of
+// VALID says whether child i exists, bit i of LEAF whether it's an
+// (alive) leaf voxel. leaves have no node of their own, so the
+// array holds internal nodes only.
+struct SVONode
+{
+  // index of the first non-leaf child in Octree::svo
+  uint32_t first_child;
+  uint8_t valid, leaf;
+
+  SVONode() : first_child(0), valid(0), leaf(0) { }
+
+  // index of child OCT in Octree::svo, which must be valid
+  // and not a leaf: skip the non-leaf children before it
+  uint32_t child(int oct) const
+  {
+    unsigned char before = valid & ~leaf & ((1 << oct) - 1);
+    return first_child + __builtin_popcount(before);
+  }
+};
+
+// first leaf hit by a ray
+struct OctreeHit
+{
+  // where the ray enters the leaf, in units of the ray direction
+  float t;
+
+  // of the face the ray enters the leaf through
+  vec3 normal;
+
+  // integer coordinates of the leaf among all leaves,
+  // each in [0, 2^(MAX_DEPTH-1))
+  int voxel[3];
+};
+
+// 8 rays traced together by Octree::closest_leaf_packet(), one
+// per lane. They should be coherent (neighboring pixels, say):
+// a node is visited if any of them goes through it.
+struct RayPacket8
+{
+  float o[3][8];
+  float d[3][8];
+
+  void set(int lane, const vec3& origin, const vec3& dir)
+  {
+    for(int i = 0; i < 3; ++i)
+    {
+      o[i][lane] = origin(i);
+      d[i][lane] = dir(i);
+    }
+  }
 };
 
 struct Octree
 {
-  Node root;
+  // outter bounding box
+  vec3 bb_min, bb_max;
+
+  // every node of the tree, the root at index 0. nodes are
+  // appended as they're created, so they're sequential in memory
+  // and releasing the whole tree is just a clear() (which keeps
+  // the memory around for the next build).
+  std::vector<Node> nodes;
+
+  // the same tree, in breadth first order, root at index 0. This
+  // is a snapshot made by compact(): queries only see points added
+  // before the last call to it.
+  std::vector<SVONode> svo;
 
+  Octree();
+
+  // drops every node, so this is also how the tree is rebuilt
   void set_aabb(const vec3& min, const vec3& max);
+  void clear();
 
   // assumes MIN and MAX are consistently defined
   void add_point(const vec3& p);
+
+  // builds svo from nodes. call it once all points are in
+  void compact();
+
   bool is_inside(const vec3& p) const;
-  float closest_leaf(const vec3& o, const vec3& d) const;
-  float closest_leaf(const vec3& o, const vec3& d, vec3& normal) const;
+
+  // side of a leaf (along X, if the bounding box is not a cube)
+  float leaf_size() const;
+
+  // closest alive leaf along o + t*d that the ray enters at some
+  // tmin < t <= tmax. Leaves the ray is already in at tmin (the
+  // one o is in, for tmin = 0) don't count, so rays leaving a
+  // surface don't hit the surface itself. d doesn't need to be
+  // normalized. Returns false if there's no such leaf.
+  bool closest_leaf(const vec3& o, const vec3& d, OctreeHit& hit,
+                    float tmin = 0.0f, float tmax = INFINITY) const;
+
+  // whether there's any leaf closest_leaf() would return, i.e.
+  // whether the segment is blocked. Cheaper: no hit to fill, and
+  // the traversal starts at the deepest node containing the whole
+  // segment, so short rays skip the upper levels of the tree (and
+  // segments in empty space return right away).
+  bool occluded(const vec3& o, const vec3& d, float tmax, float tmin = 0.0f) const;
+
+  // closest_leaf() (tmin = 0, no tmax) for the 8 rays of the
+  // packet at once, sharing the traversal: t[i] and n[i] are the
+  // OctreeHit's t and normal of ray i. Returns a mask with bit i
+  // set if ray i hit something; t[i] is NAN otherwise.
+  unsigned int closest_leaf_packet(const RayPacket8& rays, float* t, vec3* n) const;
 };
 
 #endif
@@ -11,16 +11,32 @@
 //---------------------
 class OctreeBuilderShader : public FragmentShader
 {
+private:
+  int pos_id;
+
 public:
+  void resolve_slots() override
+  {
+    pos_id = attribute_slot("pos");
+  }
+
   rgba launch(const float* vertex_in, const float* dVdx, int n) override
   {
-    vec3 pos( get_attribute("pos", vertex_in) );
+    vec3 pos( get_attribute(pos_id, vertex_in) );
     OctreeBuilderShader::tree.add_point(pos);
 
     vec3 c = (pos + vec3(1.0f, 1.0f, 1.0f)) * 0.5f;
     return rgba(c, 1.0f);
   }
 
+  void launch_batch(const float* vertex_in, const float* dVdx,
+                    int count, int stride, rgba* out) override
+  {
+    for(int i = 0; i < count; ++i)
+      out[i] = OctreeBuilderShader::launch(&vertex_in[i*stride],
+                                           &dVdx[i*stride], stride);
+  }
+
   static Octree tree;
 };
 
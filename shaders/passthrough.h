@@ -6,20 +6,43 @@
 class PassthroughShader : public VertexShader
 {
 public:
+  void resolve_slots() override
+  {
+    pos_id = attribute_slot("pos");
+  }
+
+  // no uniforms involved
+  void prepare() override {}
+
   //TODO: Make this return a vec4
   void launch(const float* vertex_in, float* vertex_out, int vertex_sz, vec4& position) override
   {
-      vec2 pos( get_attribute("pos", vertex_in) );
+      vec2 pos( get_attribute(pos_id, vertex_in) );
 
+      // halfway through the depth range: at z = 1 (the far
+      // plane) it would fail the depth test against a cleared
+      // depth buffer
       position(0) = pos(0);
       position(1) = pos(1);
-      position(2) = 1.0f;
+      position(2) = 0.0f;
       position(3) = 1.0f;
 
       // create a simple mechanism for attribute forwarding
       vertex_out[0] = pos(0);
       vertex_out[1] = pos(1);
   }
+
+  void launch_batch(const float* vertex_in, float* vertex_out,
+                    int count, int in_stride, int out_stride) override
+  {
+    for(int i = 0; i < count; ++i)
+    {
+      vec4 pos;
+      float *out = &vertex_out[i*out_stride];
+      PassthroughShader::launch(&vertex_in[i*in_stride], &out[4], in_stride, pos);
+      for(int j = 0; j < 4; ++j) out[j] = pos(j);
+    }
+  }
 };
 
 #endif
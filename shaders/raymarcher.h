@@ -1,6 +1,7 @@
 #ifndef RAYMARCHER_H
 #define RAYMARCHER_H
 
+#include <algorithm>
 #include "../include/pipeline/fragmentshader.h"
 #include "octree.h"
 
@@ -13,35 +14,98 @@ private:
   const float THETA = 45.0f;
   const float TAN_THETA_2 = tan( (PI*THETA*0.5f)/180.0f );
 
+  int pos_id, eye_id, inv_view_id;
+
+  // computed by prepare() when inv_view changes. As in the
+  // standard vertex shader, prepared_for/prepared_version
+  // identify the uniform value they were computed from
+  mat4 inv_view;
+  vec3 o_ws;
+  const std::vector<unsigned int> *prepared_for;
+  unsigned int prepared_version;
 
 public:
-  RayMarcherShader(const Octree& tree) : tree(tree) {}
+  RayMarcherShader(const Octree& tree)
+    : tree(tree), prepared_for(nullptr), prepared_version(0) {}
 
-  rgba launch(const float* vertex_in, const float* dVdx, int n) override
+  void resolve_slots() override
   {
-    vec2 pos( get_attribute("pos", vertex_in) );
-    vec3 eye( get_uniform("eye") );
-    mat4 inv_view( get_uniform("inv_view") );
+    pos_id = attribute_slot("pos");
+    eye_id = uniform_slot("eye");
+    inv_view_id = uniform_slot("inv_view");
+  }
+
+  void prepare() override
+  {
+    // inv_view was never uploaded: there's no camera to read
+    unsigned int version = uniform_version(inv_view_id);
+    if(version == 0) return;
+
+    // nothing changed since the last render() call
+    if(prepared_for == uniform_versions && prepared_version == version)
+      return;
+
+    inv_view = mat4( get_uniform(inv_view_id) );
 
+    // rays start at the camera position
     vec4 o_ = inv_view * vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    o_ws = vec3(o_(0),o_(1),o_(2));
+
+    prepared_for = uniform_versions;
+    prepared_version = version;
+  }
+
+  vec3 ray_direction(const float* vertex_in)
+  {
+    vec2 pos( get_attribute(pos_id, vertex_in) );
+
     vec4 d_ = inv_view * vec4(vec3(pos(0)*TAN_THETA_2, pos(1)*TAN_THETA_2, -0.1f).unit(), 0.0f);
-    vec3 o_ws(o_(0),o_(1),o_(2)), d_ws(d_(0),d_(1),d_(2));
-
-    // TODO: this should return some attribute, or even the
-    // leaf itself so we can do something useful
-    // Knowing whether we intersect a leaf on the voxel tree
-    // or not should be enough to compute visibilities and thus,
-    // ambient occlusion.
-    // As for actual shading I don't know
-    vec3 nr;
-    float v = tree.closest_leaf(o_ws, d_ws, nr);
-
-    //float v = tree.closest_leaf(o_ws, d_ws);
+    return vec3(d_(0),d_(1),d_(2));
+  }
+
+  // shade by the normal of the face we hit. rays
+  // that miss everything get a zero normal
+  static rgba shade(const vec3& nr)
+  {
     return rgba((nr(0)+1.0f)*0.5f,
                 (nr(1)+1.0f)*0.5f,
                 (nr(2)+1.0f)*0.5f,
                 1.0f);
   }
+
+  rgba launch(const float* vertex_in, const float* dVdx, int n) override
+  {
+    OctreeHit hit;
+    vec3 nr(0.0f, 0.0f, 0.0f);
+    if( tree.closest_leaf(o_ws, ray_direction(vertex_in), hit) ) nr = hit.normal;
+
+    return shade(nr);
+  }
+
+  // fragments in a batch come in spans of neighboring pixels of
+  // the same tile, so their primary rays are traced as packets of 8
+  void launch_batch(const float* vertex_in, const float* dVdx,
+                    int count, int stride, rgba* out) override
+  {
+    for(int i = 0; i < count; i += 8)
+    {
+      int in_packet = std::min(8, count - i);
+
+      // incomplete packets repeat their last ray
+      RayPacket8 packet;
+      for(int j = 0; j < 8; ++j)
+      {
+        int k = i + std::min(j, in_packet-1);
+        packet.set(j, o_ws, ray_direction(&vertex_in[k*stride]));
+      }
+
+      float t[8]; vec3 nr[8];
+      tree.closest_leaf_packet(packet, t, nr);
+
+      for(int j = 0; j < in_packet; ++j)
+        out[i+j] = shade(nr[j]);
+    }
+  }
 };
 
 /* NOTE: this is how we correctly invert the view matrix
@@ -0,0 +1,40 @@
+#ifndef STANDARD_SHADER_H
+#define STANDARD_SHADER_H
+
+#include <cstring>
+#include "../include/pipeline/vertexshader.h"
+
+// Same as the default VertexShader, but shading vertices in
+// batches with the matrices cached by prepare(), without going
+// through launch() for every vertex. This can't live in
+// VertexShader itself because shaders deriving from it override
+// only launch() and rely on the default launch_batch() calling it.
+class StandardShader : public VertexShader
+{
+public:
+  void launch_batch(const float* vertex_in, float* vertex_out,
+                    int count, int in_stride, int out_stride) override
+  {
+    int p_s = (*attribs)[pos_id].stride;
+    int n_s = (*attribs)[normal_id].stride;
+
+    for(int i = 0; i < count; ++i)
+    {
+      const float *in = &vertex_in[i*in_stride];
+      float *out = &vertex_out[i*out_stride];
+
+      vec4 pos = model * vec4(vec3(&in[p_s]), 1.0f);
+
+      //forward coordinates in world space and untransformed normals
+      out[4+0] = pos(0);
+      out[4+1] = pos(1);
+      out[4+2] = pos(2);
+      memcpy(&out[4+n_s], &in[n_s], 3*sizeof(float));
+
+      pos = view_proj * pos;
+      for(int j = 0; j < 4; ++j) out[j] = pos(j);
+    }
+  }
+};
+
+#endif
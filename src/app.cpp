@@ -11,10 +11,6 @@
 #include <nanogui/colorpicker.h>
 #include <nanogui/combobox.h>
 
-#include "../3rdparty/stb_image_write.h"
-
-const int GRID_RES = 512;
-
 void Engine::draw(NVGcontext *ctx)
 {
   Screen::draw(ctx);
@@ -22,119 +18,7 @@ void Engine::draw(NVGcontext *ctx)
 
 void Engine::compute_octree()
 {
-  // compute scene bounding box
-  vec3 bb_min(FLT_MAX,FLT_MAX,FLT_MAX), bb_max(-FLT_MAX,-FLT_MAX,-FLT_MAX);
-  for(int t = 0; t < mesh.pos.size(); t += 3)
-  {
-    vec4 p = model * vec4(mesh.pos[t+0],
-                          mesh.pos[t+1],
-                          mesh.pos[t+2],
-                          1.0f);
-
-    for(int j = 0; j < 3; ++j)
-    {
-      bb_min(j) = std::fmin(bb_min(j), p(j));
-      bb_max(j) = std::fmax(bb_max(j), p(j));
-    }
-  }
-
-  printf("Bounding box: \n");
-  printf("\t(%f, %f, %f) - (%f, %f, %f)\n", bb_min(0), bb_min(1), bb_min(2),
-                                            bb_max(0), bb_max(1), bb_max(2));
-
-  // compute minimal CUBIC bounding box which will be used
-  // to define the rasterization limits
-  vec3 diff = bb_max - bb_min;
-  int greatest_axis = 0;
-
-  for(int i = 0; i < 3; ++i)
-    if(diff(i) > diff(greatest_axis))
-      greatest_axis = i;
-
-  // side of the cubic bounding box
-  float l = diff(greatest_axis);
-
-  vec3 cubic_bb_min = bb_min;
-  vec3 cubic_bb_max = bb_min + vec3(l,l,l);
-
-  OctreeBuilderShader::tree.set_aabb(cubic_bb_min, cubic_bb_max);
-
-  printf("Cubic bounding box: \n");
-  printf("\t(%f, %f, %f) - (%f, %f, %f)\n", bb_min(0), bb_min(1), bb_min(2),
-                                            cubic_bb_max(0),
-                                            cubic_bb_max(1),
-                                            cubic_bb_max(2));
-
-  // setup common matrices
-  float half_l = l * 0.5f;
-  mat4 viewport = mat4::viewport(octreeTarget.width(), octreeTarget.height());
-  mat4 proj = mat4::orthogonal(-half_l, half_l, -half_l, half_l, 0.0f, l + 0.5f);
-
-  //XY view
-  vec3 eye = cubic_bb_min;
-  eye(0) = cubic_bb_min(0) + half_l;
-  eye(1) = cubic_bb_min(1) + half_l;
-  eye(2) = cubic_bb_min(2);
-  mat4 view = mat4::view(eye, eye + vec3(0.0f, 0.0f, +1.0f), vec3(0.0f, 1.0f, 0.0f));
-
-  octreeTarget.clearDepthBuffer();
-  octreeTarget.clearColorBuffer();
-  gp.set_viewport(viewport);
-
-  gp.upload_uniform("view", view.data(), 16);
-  gp.upload_uniform("model", model.data(), 16);
-  gp.upload_uniform("proj", proj.data(), 16);
-
-  gp.render(octreeTarget, false, false);
-
-  stbi_write_png("../XY.png", octreeTarget.width(), octreeTarget.height(),
-                  4, (const void*)octreeTarget.colorBuffer(),
-                  sizeof(RGBA8)*octreeTarget.width());
-
-  //XZ view
-  eye = cubic_bb_min;
-  eye(0) = cubic_bb_min(0) + half_l;
-  eye(1) = cubic_bb_min(1);
-  eye(2) = cubic_bb_min(2) + half_l;
-  view = mat4::view(eye, eye + vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 0.0f, +1.0f));
-
-  octreeTarget.clearDepthBuffer();
-  octreeTarget.clearColorBuffer();
-  gp.set_viewport(viewport);
-
-  gp.upload_uniform("view", view.data(), 16);
-  gp.upload_uniform("model", model.data(), 16);
-  gp.upload_uniform("proj", proj.data(), 16);
-
-  gp.render(octreeTarget, false, false);
-
-  stbi_write_png("../XZ.png", octreeTarget.width(), octreeTarget.height(),
-                  4, (const void*)octreeTarget.colorBuffer(),
-                  sizeof(RGBA8)*octreeTarget.width());
-
-  //YZ view
-  eye = cubic_bb_min;
-  eye(0) = cubic_bb_min(0);
-  eye(1) = cubic_bb_min(1) + half_l;
-  eye(2) = cubic_bb_min(2) + half_l;
-  view = mat4::view(eye, eye + vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
-
-  octreeTarget.clearDepthBuffer();
-  octreeTarget.clearColorBuffer();
-  gp.set_viewport(viewport);
-
-  gp.upload_uniform("view", view.data(), 16);
-  gp.upload_uniform("model", model.data(), 16);
-  gp.upload_uniform("proj", proj.data(), 16);
-
-  gp.render(octreeTarget, false, false);
-
-  stbi_write_png("../YZ.png", octreeTarget.width(), octreeTarget.height(),
-                  4, (const void*)octreeTarget.colorBuffer(),
-                  sizeof(RGBA8)*octreeTarget.width());
-
-  // -------
-  //print_node(&OctreeBuilderShader::tree.root);
+  build_octree(gp, octreeTarget, mesh, model, "../");
 }
 
 void Engine::drawContents()
@@ -172,7 +56,7 @@ void Engine::drawContents()
   renderer.upload_uniform("model", model.data(), 16);
 
   // clear and render
-  renderTarget.clearDepthBuffer();
+  renderTarget.clearDepthBuffer(renderer.depth_clear_value());
   renderTarget.clearColorBuffer();
   renderer.render(renderTarget);
 
@@ -208,7 +92,8 @@ void Engine::drawContents()
 
   //count time
   clock_t elapsed = clock() - start;
-  printf("\rTime per frame: %fs", ((double)elapsed)/CLOCKS_PER_SEC);
+  printf("\rTime per frame: %fs (%d fragments shaded)",
+          ((double)elapsed)/CLOCKS_PER_SEC, renderer.shaded_fragments());
   fflush(stdout);
 }
 
@@ -243,22 +128,11 @@ Engine::Engine(const char* path)
   param.shading = 0;
 
   // Load model and unpack.
-  // It's a bit dumb to copy each element in a for loop
-  // using push_back(), but this is just because our meshes
-  // have only position information (in the general case,
-  // at least texture coordinates would be present and we
-  // would need to store them inside mesh_data also)
+  // Vertices come deduplicated from Mesh, so we upload
+  // them along with the index buffer. Both pipelines share
+  // the very same buffer.
   mesh.load_file( std::string(path) );
-  std::vector<float> mesh_data;
-  for(int i = 0; i < mesh.pos.size(); i += 3)
-  {
-    mesh_data.push_back(mesh.pos[i+0]);
-    mesh_data.push_back(mesh.pos[i+1]);
-    mesh_data.push_back(mesh.pos[i+2]);
-    mesh_data.push_back(mesh.normal[i+0]);
-    mesh_data.push_back(mesh.normal[i+1]);
-    mesh_data.push_back(mesh.normal[i+2]);
-  }
+  VertexBufferRef mesh_data = mesh_vertex_buffer(mesh);
 
   mesh.transform_to_center(model);
 
@@ -289,6 +163,16 @@ Engine::Engine(const char* path)
   //renderer.set_fragment_shader(raymarch);
   //renderer.set_vertex_shader(passthrough);
 
+  // the octree builder shader writes to the tree on every
+  // fragment, so only the final renderer can rasterize in
+  // parallel. Vertex processing is parallel in both.
+  gp.set_threads(0);
+  renderer.set_tiled_rasterization(true);
+
+  // ambient occlusion is expensive enough that we don't want
+  // to run it for fragments which will be overdrawn later
+  renderer.set_deferred_shading(true);
+
   shader.init("passthrough",
 
               //Vertex shader
@@ -326,11 +210,11 @@ Engine::Engine(const char* path)
   // ---------------------------------
   // ---------- Upload data ----------
   // ---------------------------------
-  gp.upload_data(mesh_data, 6);
+  gp.upload_data(mesh_data);
   gp.define_attribute("pos", 3, 0);
   gp.define_attribute("normal", 3, 3);
 
-  renderer.upload_data(mesh_data, 6);
+  renderer.upload_data(mesh_data);
   renderer.define_attribute("pos", 3, 0);
   renderer.define_attribute("normal", 3, 3);
 
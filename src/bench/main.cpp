@@ -0,0 +1,424 @@
+// Benchmark: renders a fixed set of scenes at fixed resolutions and
+// reports the wall clock time of every pipeline stage, plus triangle,
+// fragment and pixel throughput, as JSON. Scenes are rendered exactly
+// as in the viewer/headless renderer, so regressions show up here.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../include/scene.h"
+#include "../../shaders/normal.h"
+
+typedef SpecializedPipeline<StandardShader, NormalShader,
+                            VertexLayout<6> > MeshPipeline;
+
+struct Resolution
+{
+  int width, height;
+};
+
+// averages over the measured frames of a scene
+struct SceneResult
+{
+  std::string name;
+  Resolution res;
+  int triangles;
+
+  double frame;
+  StageTimes stages;
+  double fragments, pixels;
+
+  // summed over all measured frames
+  PipelineStats stats;
+};
+
+static void usage(const char* program)
+{
+  printf("usage: %s [model.obj] [options]\n"
+          "  -s WxH       frame size. May be repeated, every scene is\n"
+          "               rendered at every size (default: 960x540, 1920x1080)\n"
+          "  -f N         measured frames per scene (default: 10)\n"
+          "  -w N         warm up frames per scene (default: 2)\n"
+          "  -t N         number of threads (default: one per core)\n"
+          "  -o FILE      JSON output (default: bench.json)\n"
+          "Without a model, a tessellated sphere is used as the dense mesh.\n",
+          program);
+}
+
+// ------------------------------------
+// --------- Procedural meshes --------
+// ------------------------------------
+// faces are counter clockwise seen from outside, as
+// expected by back face culling
+static void make_cube(Mesh& mesh)
+{
+  for(int axis = 0; axis < 3; ++axis)
+    for(int sign = -1; sign <= 1; sign += 2)
+    {
+      // u x v = normal
+      int u = (axis + (sign > 0 ? 1 : 2)) % 3;
+      int v = (axis + (sign > 0 ? 2 : 1)) % 3;
+
+      const float corners[4][2] = { {-0.5f, -0.5f}, {0.5f, -0.5f},
+                                    {0.5f, 0.5f}, {-0.5f, 0.5f} };
+      int base = (int)mesh.pos.size() / 3;
+      for(int c = 0; c < 4; ++c)
+      {
+        float p[3], n[3] = {0.0f, 0.0f, 0.0f};
+        p[axis] = 0.5f * sign;
+        p[u] = corners[c][0];
+        p[v] = corners[c][1];
+        n[axis] = (float)sign;
+
+        mesh.pos.insert(mesh.pos.end(), p, p+3);
+        mesh.normal.insert(mesh.normal.end(), n, n+3);
+      }
+
+      const int quad[6] = {0, 1, 2, 0, 2, 3};
+      for(int i = 0; i < 6; ++i)
+        mesh.indices.push_back(base + quad[i]);
+    }
+}
+
+static void make_sphere(Mesh& mesh, int rings, int segments)
+{
+  for(int i = 0; i <= rings; ++i)
+    for(int j = 0; j <= segments; ++j)
+    {
+      float theta = PI * i / rings, phi = 2.0f * PI * j / segments;
+      float p[3] = { sinf(theta)*cosf(phi), cosf(theta), sinf(theta)*sinf(phi) };
+
+      mesh.pos.insert(mesh.pos.end(), p, p+3);
+      mesh.normal.insert(mesh.normal.end(), p, p+3);
+    }
+
+  for(int i = 0; i < rings; ++i)
+    for(int j = 0; j < segments; ++j)
+    {
+      int p = i*(segments+1) + j, q = p + 1;
+      int r = p + segments + 1, u = r + 1;
+
+      const int tris[6] = {p, q, r, q, u, r};
+      mesh.indices.insert(mesh.indices.end(), tris, tris+6);
+    }
+}
+
+// ------------------------------------
+// ------------ Measuring -------------
+// ------------------------------------
+static int covered_pixels(const Framebuffer& target, float clear_depth)
+{
+  int covered = 0;
+  for(int i = 0; i < target.height(); ++i)
+    for(int j = 0; j < target.width(); ++j)
+      if(target.getDepthBuffer(i, j) != clear_depth)
+        covered++;
+
+  return covered;
+}
+
+template<class Pipeline>
+static SceneResult run_scene(const char* name, Pipeline& gp, int n_triangles,
+                              Resolution res, int warmup, int frames,
+                              bool culling = true)
+{
+  Framebuffer target(res.width, res.height);
+  gp.set_viewport(mat4::viewport(res.width, res.height));
+  gp.set_profiling(true);
+
+  SceneResult r;
+  r.name = name;
+  r.res = res;
+  r.triangles = n_triangles;
+  r.frame = r.fragments = r.pixels = 0.0;
+  r.stages = StageTimes();
+  r.stats = PipelineStats();
+
+  for(int f = 0; f < warmup + frames; ++f)
+  {
+    target.clearDepthBuffer(gp.depth_clear_value());
+    target.clearColorBuffer();
+
+    PipelineStats stats;
+    auto start = std::chrono::steady_clock::now();
+    gp.render(target, true, culling, true, true, &stats);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if(f < warmup) continue;
+
+    StageTimes t = gp.stage_times();
+    r.frame += elapsed.count();
+    r.stages.vertex += t.vertex;
+    r.stages.clip += t.clip;
+    r.stages.divide += t.divide;
+    r.stages.cull += t.cull;
+    r.stages.raster += t.raster;
+    r.stages.fragment += t.fragment;
+    r.fragments += gp.shaded_fragments();
+    r.pixels += covered_pixels(target, gp.depth_clear_value());
+
+    r.stats.vertices_shaded += stats.vertices_shaded;
+    r.stats.triangles_clipped += stats.triangles_clipped;
+    r.stats.triangles_culled += stats.triangles_culled;
+    r.stats.triangles_rasterized += stats.triangles_rasterized;
+    r.stats.fragments_generated += stats.fragments_generated;
+    r.stats.fragments_depth_failed += stats.fragments_depth_failed;
+    r.stats.fragment_shader_invocations += stats.fragment_shader_invocations;
+    r.stats.pixels_written += stats.pixels_written;
+  }
+
+  r.frame /= frames;
+  r.stages.vertex /= frames;
+  r.stages.clip /= frames;
+  r.stages.divide /= frames;
+  r.stages.cull /= frames;
+  r.stages.raster /= frames;
+  r.stages.fragment /= frames;
+  r.fragments /= frames;
+  r.pixels /= frames;
+
+  printf("%-12s %4dx%-4d %8.3fms/frame (vertex %.3f, clip %.3f, divide %.3f, "
+          "cull %.3f, raster %.3f, fragment %.3f)\n",
+          name, res.width, res.height, 1000.0*r.frame,
+          1000.0*r.stages.vertex, 1000.0*r.stages.clip, 1000.0*r.stages.divide,
+          1000.0*r.stages.cull, 1000.0*r.stages.raster, 1000.0*r.stages.fragment);
+
+  return r;
+}
+
+static bool write_json(const char* path, const std::vector<SceneResult>& results,
+                        int threads, int frames)
+{
+  FILE *f = fopen(path, "w");
+  if(!f) return false;
+
+  fprintf(f, "{\n  \"threads\": %d,\n  \"frames\": %d,\n  \"scenes\": [\n",
+          threads, frames);
+
+  for(int i = 0; i < (int)results.size(); ++i)
+  {
+    const SceneResult& r = results[i];
+    const StageTimes& s = r.stages;
+
+    // times in milliseconds per frame, rates per second
+    fprintf(f, "    {\n");
+    fprintf(f, "      \"name\": \"%s\",\n", r.name.c_str());
+    fprintf(f, "      \"width\": %d,\n      \"height\": %d,\n", r.res.width, r.res.height);
+    fprintf(f, "      \"triangles\": %d,\n", r.triangles);
+    fprintf(f, "      \"frame_ms\": %.4f,\n", 1000.0*r.frame);
+    fprintf(f, "      \"stages_ms\": { \"vertex\": %.4f, \"clip\": %.4f, \"divide\": %.4f, "
+                "\"cull\": %.4f, \"raster\": %.4f, \"fragment\": %.4f },\n",
+            1000.0*s.vertex, 1000.0*s.clip, 1000.0*s.divide,
+            1000.0*s.cull, 1000.0*s.raster, 1000.0*s.fragment);
+    fprintf(f, "      \"fragments\": %.1f,\n", r.fragments);
+    fprintf(f, "      \"shaded_pixels\": %.1f,\n", r.pixels);
+    fprintf(f, "      \"triangles_per_s\": %.1f,\n", r.triangles / r.frame);
+    fprintf(f, "      \"fragments_per_s\": %.1f,\n", r.fragments / r.frame);
+    fprintf(f, "      \"shaded_pixels_per_s\": %.1f%s\n", r.pixels / r.frame,
+            PIPELINE_STATS ? "," : "");
+
+    // pipeline statistics, per frame. Not available in release builds
+#if PIPELINE_STATS
+    const PipelineStats& st = r.stats;
+    fprintf(f, "      \"stats\": { \"vertices_shaded\": %lld, \"triangles_clipped\": %lld, "
+                "\"triangles_culled\": %lld, \"triangles_rasterized\": %lld, "
+                "\"fragments_generated\": %lld, \"fragments_depth_failed\": %lld, "
+                "\"fragment_shader_invocations\": %lld, \"pixels_written\": %lld }\n",
+            st.vertices_shaded / frames, st.triangles_clipped / frames,
+            st.triangles_culled / frames, st.triangles_rasterized / frames,
+            st.fragments_generated / frames, st.fragments_depth_failed / frames,
+            st.fragment_shader_invocations / frames, st.pixels_written / frames);
+#endif
+    fprintf(f, "    }%s\n", i+1 < (int)results.size() ? "," : "");
+  }
+
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char** args)
+{
+  const char *model_path = nullptr, *output = "bench.json";
+  int frames = 10, warmup = 2, n_threads = 0;
+  std::vector<Resolution> resolutions;
+
+  // ----------------------------------
+  // ------- Command line options -----
+  // ----------------------------------
+  for(int i = 1; i < argc; ++i)
+  {
+    std::string opt = args[i];
+    int left = argc - i - 1;
+
+    if(opt[0] != '-' && !model_path)
+      model_path = args[i];
+    else if(opt == "-s" && left >= 1)
+    {
+      Resolution res;
+      if(sscanf(args[++i], "%dx%d", &res.width, &res.height) != 2 ||
+          res.width <= 0 || res.height <= 0)
+      {
+        printf("ERROR: invalid frame size %s\n", args[i]);
+        return 1;
+      }
+      resolutions.push_back(res);
+    }
+    else if(opt == "-f" && left >= 1)
+      frames = std::max(1, atoi(args[++i]));
+    else if(opt == "-w" && left >= 1)
+      warmup = std::max(0, atoi(args[++i]));
+    else if(opt == "-t" && left >= 1)
+      n_threads = atoi(args[++i]);
+    else if(opt == "-o" && left >= 1)
+      output = args[++i];
+    else
+    {
+      printf("ERROR: unknown or incomplete option %s\n", args[i]);
+      usage(args[0]);
+      return 1;
+    }
+  }
+
+  if(resolutions.empty())
+  {
+    Resolution defaults[2] = { {960, 540}, {1920, 1080} };
+    resolutions.assign(defaults, defaults+2);
+  }
+
+  // --------------------------------
+  // --------- Scene setup ----------
+  // --------------------------------
+  Mesh cube, mesh;
+  make_cube(cube);
+
+  if(model_path)
+  {
+    mesh.load_file( std::string(model_path) );
+    if(mesh.indices.empty())
+    {
+      printf("ERROR: no triangles in %s\n", model_path);
+      return 1;
+    }
+  }
+  else make_sphere(mesh, 256, 512);
+
+  mat4 cube_model, mesh_model;
+  cube.transform_to_center(cube_model);
+  mesh.transform_to_center(mesh_model);
+  VertexBufferRef cube_data = mesh_vertex_buffer(cube);
+  VertexBufferRef mesh_data = mesh_vertex_buffer(mesh);
+
+  // every scene is seen from the same camera
+  mat4 view = mat4::view(vec3(0.9f, 0.6f, 1.5f), vec3(0.0f, 0.0f, 0.0f),
+                          vec3(0.0f, 1.0f, 0.0f));
+  mat4 proj = mat4::perspective(45.0f, 45.0f, 0.5f, 5.0f);
+
+  // flat shaded geometry: cost of the fixed stages. Shaders
+  // are bound to a single pipeline, so each one has its own
+  StandardShader standard_cube, standard_mesh;
+  NormalShader normal_cube, normal_mesh;
+  MeshPipeline cube_gp, mesh_gp;
+
+  cube_gp.set_vertex_shader(standard_cube);
+  cube_gp.set_fragment_shader(normal_cube);
+  cube_gp.set_tiled_rasterization(true, n_threads);
+  cube_gp.upload_data(cube_data);
+  cube_gp.define_attribute("pos", 3, 0);
+  cube_gp.define_attribute("normal", 3, 3);
+  cube_gp.upload_uniform("model", cube_model.data(), 16);
+  cube_gp.upload_uniform("view", view.data(), 16);
+  cube_gp.upload_uniform("proj", proj.data(), 16);
+
+  mesh_gp.set_vertex_shader(standard_mesh);
+  mesh_gp.set_fragment_shader(normal_mesh);
+  mesh_gp.set_tiled_rasterization(true, n_threads);
+  mesh_gp.upload_data(mesh_data);
+  mesh_gp.define_attribute("pos", 3, 0);
+  mesh_gp.define_attribute("normal", 3, 3);
+  mesh_gp.upload_uniform("model", mesh_model.data(), 16);
+  mesh_gp.upload_uniform("view", view.data(), 16);
+  mesh_gp.upload_uniform("proj", proj.data(), 16);
+
+  // both the AO shader and the raymarcher trace the octree
+  // of the dense mesh. Building it is not measured
+  StandardShader standard_voxelizer;
+  OctreeBuilderShader voxelizer;
+  VoxelizerPipeline voxelizer_gp;
+  voxelizer_gp.set_vertex_shader(standard_voxelizer);
+  voxelizer_gp.set_fragment_shader(voxelizer);
+  voxelizer_gp.set_threads(n_threads);
+  voxelizer_gp.upload_data(mesh_data);
+  voxelizer_gp.define_attribute("pos", 3, 0);
+  voxelizer_gp.define_attribute("normal", 3, 3);
+
+  Framebuffer octreeTarget(GRID_RES, GRID_RES);
+  build_octree(voxelizer_gp, octreeTarget, mesh, mesh_model);
+
+  // ambient occlusion, as in the viewer
+  StandardShader standard_ao;
+  AmbientOcclusionShader amb_occ(OctreeBuilderShader::tree);
+  AOPipeline ao_gp;
+  ao_gp.set_vertex_shader(standard_ao);
+  ao_gp.set_fragment_shader(amb_occ);
+  ao_gp.set_tiled_rasterization(true, n_threads);
+  ao_gp.set_deferred_shading(true);
+  ao_gp.upload_data(mesh_data);
+  ao_gp.define_attribute("pos", 3, 0);
+  ao_gp.define_attribute("normal", 3, 3);
+  ao_gp.upload_uniform("model", mesh_model.data(), 16);
+  ao_gp.upload_uniform("view", view.data(), 16);
+  ao_gp.upload_uniform("proj", proj.data(), 16);
+
+  // voxel raytracing: a screen quad invoking the
+  // fragment shader once per pixel
+  const float quad[] = { -1.0f, -1.0f,  +1.0f, -1.0f,  +1.0f, +1.0f,
+                          -1.0f, -1.0f,  +1.0f, +1.0f,  -1.0f, +1.0f };
+  std::vector<float> quad_data(quad, quad + 12);
+
+  mat4 inv_view = view.inverse();
+  vec3 eye(0.9f, 0.6f, 1.5f);
+
+  PassthroughShader passthrough;
+  RayMarcherShader raymarch(OctreeBuilderShader::tree);
+  RayMarcherPipeline ray_gp;
+  ray_gp.set_vertex_shader(passthrough);
+  ray_gp.set_fragment_shader(raymarch);
+  ray_gp.set_tiled_rasterization(true, n_threads);
+  ray_gp.upload_data(quad_data);
+  ray_gp.define_attribute("pos", 2, 0);
+  ray_gp.upload_uniform("inv_view", inv_view.data(), 16);
+  ray_gp.upload_uniform("eye", eye.data(), 3);
+
+  // ----------------------------
+  // --------- Render -----------
+  // ----------------------------
+  int n_mesh_tris = (int)mesh.indices.size() / 3;
+  std::vector<SceneResult> results;
+
+  for(auto res = resolutions.begin(); res != resolutions.end(); ++res)
+  {
+    results.push_back(run_scene("cube", cube_gp, (int)cube.indices.size() / 3,
+                                *res, warmup, frames));
+    results.push_back(run_scene("mesh", mesh_gp, n_mesh_tris,
+                                *res, warmup, frames));
+    results.push_back(run_scene("ao", ao_gp, n_mesh_tris,
+                                *res, warmup, frames));
+    results.push_back(run_scene("raymarcher", ray_gp, 2,
+                                *res, warmup, frames, false));
+  }
+
+  int threads = n_threads > 0 ? n_threads : (int)std::thread::hardware_concurrency();
+  if(!write_json(output, results, threads, frames))
+  {
+    printf("ERROR: could not write %s\n", output);
+    return 1;
+  }
+
+  return 0;
+}
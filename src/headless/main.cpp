@@ -0,0 +1,223 @@
+// Offline renderer: same scene and shaders as the interactive
+// viewer (see app.cpp), but frames are written to disk and nothing
+// here depends on nanogui/GL, so it runs on machines without display.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../../include/scene.h"
+
+#include "../../3rdparty/stb_image_write.h"
+
+struct View
+{
+  vec3 eye, look_at;
+};
+
+static void usage(const char* program)
+{
+  printf("usage: %s model.obj [options]\n"
+          "  -o PATTERN               output files, printf-style with the frame\n"
+          "                           number (default: frame_%%04d.png)\n"
+          "  -s WxH                   frame size (default: %dx%d)\n"
+          "  -v ex ey ez lx ly lz     camera at (ex,ey,ez) looking at (lx,ly,lz).\n"
+          "                           May be repeated, one frame per view\n"
+          "  -p FILE                  camera path: one view per line, as in -v\n"
+          "  -orbit N R               N views around the Y axis at distance R,\n"
+          "                           looking at the origin\n"
+          "  -t N                     number of threads (default: one per core)\n"
+          "Without views, the default camera of the viewer is used.\n",
+          program, 960, 540);
+}
+
+static bool parse_floats(char** args, int n, float* out)
+{
+  for(int i = 0; i < n; ++i)
+  {
+    char *end;
+    out[i] = strtof(args[i], &end);
+    if(end == args[i] || *end) return false;
+  }
+  return true;
+}
+
+static bool load_path(const char* file, std::vector<View>& views)
+{
+  FILE *f = fopen(file, "r");
+  if(!f) return false;
+
+  float v[6];
+  while(fscanf(f, "%f %f %f %f %f %f", &v[0], &v[1], &v[2],
+                                        &v[3], &v[4], &v[5]) == 6)
+  {
+    View view = { vec3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]) };
+    views.push_back(view);
+  }
+
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char** args)
+{
+  if(argc < 2 || args[1][0] == '-')
+  {
+    usage(args[0]);
+    return 1;
+  }
+
+  const char *model_path = args[1];
+  std::string pattern = "frame_%04d.png";
+  int width = 960, height = 540, n_threads = 0;
+  std::vector<View> views;
+
+  // ----------------------------------
+  // ------- Command line options -----
+  // ----------------------------------
+  for(int i = 2; i < argc; ++i)
+  {
+    std::string opt = args[i];
+    int left = argc - i - 1;
+
+    if(opt == "-o" && left >= 1)
+      pattern = args[++i];
+    else if(opt == "-s" && left >= 1)
+    {
+      if(sscanf(args[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+      {
+        printf("ERROR: invalid frame size %s\n", args[i]);
+        return 1;
+      }
+    }
+    else if(opt == "-v" && left >= 6)
+    {
+      float v[6];
+      if(!parse_floats(&args[i+1], 6, v))
+      {
+        printf("ERROR: invalid view\n");
+        return 1;
+      }
+
+      View view = { vec3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]) };
+      views.push_back(view);
+      i += 6;
+    }
+    else if(opt == "-p" && left >= 1)
+    {
+      if(!load_path(args[++i], views))
+      {
+        printf("ERROR: could not read camera path %s\n", args[i]);
+        return 1;
+      }
+    }
+    else if(opt == "-orbit" && left >= 2)
+    {
+      int n = atoi(args[i+1]);
+      float r = (float)atof(args[i+2]);
+      for(int k = 0; k < n; ++k)
+      {
+        float angle = 2.0f * PI * k / n;
+        View view = { vec3(r*sin(angle), 0.0f, r*cos(angle)), vec3(0.0f, 0.0f, 0.0f) };
+        views.push_back(view);
+      }
+      i += 2;
+    }
+    else if(opt == "-t" && left >= 1)
+      n_threads = atoi(args[++i]);
+    else
+    {
+      printf("ERROR: unknown or incomplete option %s\n", args[i]);
+      usage(args[0]);
+      return 1;
+    }
+  }
+
+  // same as the viewer
+  if(views.empty())
+  {
+    View view = { vec3(0.0f, 0.0f, 0.7f), vec3(0.0f, 0.0f, -0.3f) };
+    views.push_back(view);
+  }
+
+  // --------------------------------
+  // --------- Scene setup ----------
+  // --------------------------------
+  Mesh mesh;
+  mesh.load_file( std::string(model_path) );
+  if(mesh.indices.empty())
+  {
+    printf("ERROR: no triangles in %s\n", model_path);
+    return 1;
+  }
+
+  mat4 model;
+  mesh.transform_to_center(model);
+  VertexBufferRef mesh_data = mesh_vertex_buffer(mesh);
+
+  // octree build up. The builder shader writes to the
+  // tree, so only vertex processing runs in parallel
+  StandardShader standard;
+  OctreeBuilderShader voxelizer;
+  VoxelizerPipeline gp;
+  gp.set_vertex_shader(standard);
+  gp.set_fragment_shader(voxelizer);
+  gp.set_threads(n_threads);
+  gp.upload_data(mesh_data);
+  gp.define_attribute("pos", 3, 0);
+  gp.define_attribute("normal", 3, 3);
+
+  Framebuffer octreeTarget(GRID_RES, GRID_RES);
+  build_octree(gp, octreeTarget, mesh, model);
+
+  // ambient occlusion renderer
+  StandardShader standard_renderer;
+  AmbientOcclusionShader amb_occ(OctreeBuilderShader::tree);
+  AOPipeline renderer;
+  renderer.set_vertex_shader(standard_renderer);
+  renderer.set_fragment_shader(amb_occ);
+  renderer.set_tiled_rasterization(true, n_threads);
+  renderer.set_deferred_shading(true);
+  renderer.upload_data(mesh_data);
+  renderer.define_attribute("pos", 3, 0);
+  renderer.define_attribute("normal", 3, 3);
+
+  // ----------------------------
+  // --------- Render -----------
+  // ----------------------------
+  Framebuffer renderTarget(width, height);
+  renderer.set_viewport(mat4::viewport(width, height));
+
+  mat4 proj = mat4::perspective(45.0f, 45.0f, 0.5f, 5.0f);
+  renderer.upload_uniform("proj", proj.data(), 16);
+  renderer.upload_uniform("model", model.data(), 16);
+
+  for(int i = 0; i < (int)views.size(); ++i)
+  {
+    auto start = std::chrono::steady_clock::now();
+
+    mat4 view = mat4::view(views[i].eye, views[i].look_at, vec3(0.0f, 1.0f, 0.0f));
+    renderer.upload_uniform("view", view.data(), 16);
+
+    renderTarget.clearDepthBuffer(renderer.depth_clear_value());
+    renderTarget.clearColorBuffer();
+    renderer.render(renderTarget);
+
+    char path[1024];
+    snprintf(path, sizeof(path), pattern.c_str(), i);
+    if(!stbi_write_png(path, width, height, 4, (const void*)renderTarget.colorBuffer(),
+                        sizeof(RGBA8)*width))
+    {
+      printf("ERROR: could not write %s\n", path);
+      return 1;
+    }
+
+    // wall time: clock() would add up the time of every thread
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%s: %fs (%d fragments shaded)\n", path,
+            elapsed.count(), renderer.shaded_fragments());
+  }
+
+  return 0;
+}
@@ -9,7 +9,6 @@
 
 #include "../include/app.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../3rdparty/stb_image_write.h"
 
 int main(int argc, char** args)
@@ -184,3 +184,58 @@ vec4 mat4::operator*(const vec4& rhs) const
       out(i) += (*this)(i,k) * rhs(k);
   return out;
 }
+
+mat4 mat4::transpose() const
+{
+  mat4 out;
+  for(int i = 0; i < 4; ++i)
+    for(int j = 0; j < 4; ++j)
+      out(i,j) = (*this)(j,i);
+  return out;
+}
+
+mat4 mat4::inverse() const
+{
+  // determinants of the 2x2 submatrices made of the first two
+  // rows (s) and the last two rows (c), which are shared by all
+  // the cofactors
+  const mat4& m = *this;
+  float s0 = m(0,0)*m(1,1) - m(1,0)*m(0,1);
+  float s1 = m(0,0)*m(1,2) - m(1,0)*m(0,2);
+  float s2 = m(0,0)*m(1,3) - m(1,0)*m(0,3);
+  float s3 = m(0,1)*m(1,2) - m(1,1)*m(0,2);
+  float s4 = m(0,1)*m(1,3) - m(1,1)*m(0,3);
+  float s5 = m(0,2)*m(1,3) - m(1,2)*m(0,3);
+
+  float c5 = m(2,2)*m(3,3) - m(3,2)*m(2,3);
+  float c4 = m(2,1)*m(3,3) - m(3,1)*m(2,3);
+  float c3 = m(2,1)*m(3,2) - m(3,1)*m(2,2);
+  float c2 = m(2,0)*m(3,3) - m(3,0)*m(2,3);
+  float c1 = m(2,0)*m(3,2) - m(3,0)*m(2,2);
+  float c0 = m(2,0)*m(3,1) - m(3,0)*m(2,1);
+
+  float inv_det = 1.0f / (s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0);
+
+  mat4 out;
+  out(0,0) = ( m(1,1)*c5 - m(1,2)*c4 + m(1,3)*c3) * inv_det;
+  out(0,1) = (-m(0,1)*c5 + m(0,2)*c4 - m(0,3)*c3) * inv_det;
+  out(0,2) = ( m(3,1)*s5 - m(3,2)*s4 + m(3,3)*s3) * inv_det;
+  out(0,3) = (-m(2,1)*s5 + m(2,2)*s4 - m(2,3)*s3) * inv_det;
+
+  out(1,0) = (-m(1,0)*c5 + m(1,2)*c2 - m(1,3)*c1) * inv_det;
+  out(1,1) = ( m(0,0)*c5 - m(0,2)*c2 + m(0,3)*c1) * inv_det;
+  out(1,2) = (-m(3,0)*s5 + m(3,2)*s2 - m(3,3)*s1) * inv_det;
+  out(1,3) = ( m(2,0)*s5 - m(2,2)*s2 + m(2,3)*s1) * inv_det;
+
+  out(2,0) = ( m(1,0)*c4 - m(1,1)*c2 + m(1,3)*c0) * inv_det;
+  out(2,1) = (-m(0,0)*c4 + m(0,1)*c2 - m(0,3)*c0) * inv_det;
+  out(2,2) = ( m(3,0)*s4 - m(3,1)*s2 + m(3,3)*s0) * inv_det;
+  out(2,3) = (-m(2,0)*s4 + m(2,1)*s2 - m(2,3)*s0) * inv_det;
+
+  out(3,0) = (-m(1,0)*c3 + m(1,1)*c1 - m(1,2)*c0) * inv_det;
+  out(3,1) = ( m(0,0)*c3 - m(0,1)*c1 + m(0,2)*c0) * inv_det;
+  out(3,2) = (-m(3,0)*s3 + m(3,1)*s1 - m(3,2)*s0) * inv_det;
+  out(3,3) = ( m(2,0)*s3 - m(2,1)*s1 + m(2,2)*s0) * inv_det;
+
+  return out;
+}
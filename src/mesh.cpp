@@ -1,8 +1,11 @@
 #include "../include/mesh.h"
 #include "../include/matrix.h"
+#include <cfloat>
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <map>
+#include <tuple>
 
 static std::string basedir_from_path(const std::string& path)
 {
@@ -91,6 +94,9 @@ void Mesh::load_geometry_data(const std::vector<tinyobj::shape_t>& shapes,
 {
   //this->tris.clear();
 
+  //maps position/normal/uv indices to our vertex index
+  std::map< std::tuple<int,int,int>, int > vertex_ids;
+
   //load triangles for each shape
   for(auto s = shapes.begin(); s != shapes.end(); ++s)
   {
@@ -107,6 +113,21 @@ void Mesh::load_geometry_data(const std::vector<tinyobj::shape_t>& shapes,
       {
         tinyobj::index_t v = s->mesh.indices[attrib_offset + v_id];
 
+        //reuse the vertex if we've already seen this combination
+        //of position/normal/uv indices
+        std::tuple<int,int,int> key(v.vertex_index, v.normal_index,
+                                    v.texcoord_index);
+        auto cached = vertex_ids.find(key);
+        if(cached != vertex_ids.end())
+        {
+          indices.push_back(cached->second);
+          continue;
+        }
+
+        int id = (int)(pos.size() / 3);
+        vertex_ids[key] = id;
+        indices.push_back(id);
+
         float vx = attrib.vertices[3*v.vertex_index + 0];
         float vy = attrib.vertices[3*v.vertex_index + 1];
         float vz = attrib.vertices[3*v.vertex_index + 2];
@@ -0,0 +1,110 @@
+#include "../../include/pipeline/arena.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+ScratchArena::ScratchArena()
+  : last(nullptr), last_sz(0), used(0), high_water(0), grows(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+  for(auto b = blocks.begin(); b != blocks.end(); ++b)
+    free(b->data);
+}
+
+void ScratchArena::add_block(size_t min_size)
+{
+  size_t capacity = 0;
+  for(auto b = blocks.begin(); b != blocks.end(); ++b)
+    capacity += b->size;
+
+  // geometric growth: the new block at least doubles the capacity
+  Block b;
+  b.size = std::max(min_size, std::max(capacity, (size_t)1 << 16));
+  b.size = (b.size + ALIGNMENT-1) / ALIGNMENT * ALIGNMENT;
+  b.data = (char*)aligned_alloc(ALIGNMENT, b.size);
+  b.used = 0;
+  blocks.push_back(b);
+
+  grows++;
+}
+
+void ScratchArena::reset()
+{
+  // the last frame didn't fit in a single block: merge
+  // them all, so it fits next time
+  if(blocks.size() > 1)
+  {
+    size_t capacity = 0;
+    for(auto b = blocks.begin(); b != blocks.end(); ++b)
+    {
+      capacity += b->size;
+      free(b->data);
+    }
+
+    Block b;
+    b.size = capacity;
+    b.data = (char*)aligned_alloc(ALIGNMENT, b.size);
+    blocks.assign(1, b);
+  }
+
+  for(auto b = blocks.begin(); b != blocks.end(); ++b)
+    b->used = 0;
+
+  last = nullptr; last_sz = 0;
+  used = 0;
+}
+
+void* ScratchArena::allocate(size_t bytes)
+{
+  bytes = (bytes + ALIGNMENT-1) / ALIGNMENT * ALIGNMENT;
+
+  if(blocks.empty() || blocks.back().used + bytes > blocks.back().size)
+    add_block(bytes);
+
+  Block& b = blocks.back();
+  void *p = b.data + b.used;
+  b.used += bytes;
+
+  last = p; last_sz = bytes;
+  used += bytes;
+  high_water = std::max(high_water, used);
+
+  return p;
+}
+
+void* ScratchArena::grow(void* p, size_t old_bytes, size_t new_bytes)
+{
+  new_bytes = (new_bytes + ALIGNMENT-1) / ALIGNMENT * ALIGNMENT;
+  if(new_bytes <= last_sz && p == last) return p;
+
+  // in place
+  Block& b = blocks.back();
+  if(p && p == last && b.used - last_sz + new_bytes <= b.size)
+  {
+    b.used += new_bytes - last_sz;
+    used += new_bytes - last_sz;
+    high_water = std::max(high_water, used);
+    last_sz = new_bytes;
+    return p;
+  }
+
+  void *grown = allocate(new_bytes);
+  if(p) memcpy(grown, p, old_bytes);
+  return grown;
+}
+
+ArenaStats ScratchArena::stats() const
+{
+  ArenaStats s;
+  s.capacity = 0;
+  for(auto b = blocks.begin(); b != blocks.end(); ++b)
+    s.capacity += b->size;
+
+  s.used = used;
+  s.high_water = high_water;
+  s.grows = grows;
+  return s;
+}
@@ -49,3 +49,10 @@ rgba FragmentShader::launch(const float* vertex_in, const float* dVdx, int n)
 
   return rgba(0.0f, 1.0f, 0.0f, 1.0f);
 }
+
+void FragmentShader::launch_batch(const float* vertex_in, const float* dVdx,
+                                  int count, int stride, rgba* out)
+{
+  for(int i = 0; i < count; ++i)
+    out[i] = launch(&vertex_in[i*stride], &dVdx[i*stride], stride);
+}
@@ -1,23 +1,59 @@
 #include "../../include/pipeline/framebuffer.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
 
 Framebuffer::Framebuffer()
 {
   color = nullptr;
   depth = nullptr;
-  w = h = 0;
+  hiz_max = nullptr;
+  hiz_dirty = nullptr;
+  gbuffer = nullptr;
+  gbuffer_covered = nullptr;
+  w = h = hiz_w = hiz_h = gbuffer_elem_sz = 0;
 }
 
-Framebuffer::Framebuffer(int w, int h) : w(w), h(h)
+Framebuffer::Framebuffer(int w, int h)
 {
-  int n_pixels = w*h;
-  color = new RGBA8[n_pixels];
-  depth = new float[n_pixels];
+  allocate(w, h);
 }
 
 Framebuffer::~Framebuffer()
+{
+  release();
+}
+
+void Framebuffer::allocate(int w, int h)
+{
+  this->w = w; this->h = h;
+  color = new RGBA8[w*h];
+  depth = new float[w*h];
+
+  hiz_w = (w + HIZ_TILE - 1) / HIZ_TILE;
+  hiz_h = (h + HIZ_TILE - 1) / HIZ_TILE;
+  hiz_max = new float[hiz_w*hiz_h];
+  hiz_dirty = new unsigned char[hiz_w*hiz_h];
+
+  // depth contents are undefined until the first clear, so
+  // the first query of any tile must look at the actual buffer
+  for(int i = 0; i < hiz_w*hiz_h; ++i) hiz_max[i] = FLT_MAX;
+  memset((void*)hiz_dirty, 1, hiz_w*hiz_h);
+
+  // G-buffer is allocated on demand
+  gbuffer_elem_sz = 0;
+  gbuffer = nullptr;
+  gbuffer_covered = nullptr;
+}
+
+void Framebuffer::release()
 {
   if(color) delete[] color;
   if(depth) delete[] depth;
+  if(hiz_max) delete[] hiz_max;
+  if(hiz_dirty) delete[] hiz_dirty;
+  if(gbuffer) delete[] gbuffer;
+  if(gbuffer_covered) delete[] gbuffer_covered;
 }
 
 void Framebuffer::resizeBuffer(int w, int h)
@@ -26,9 +62,8 @@ void Framebuffer::resizeBuffer(int w, int h)
   //to use std::vector which is able to do some smart resizing,
   //so it doesn't need to copy data around in the case where
   //we can just extend or shrink memory
-  this->w = w; this->h = h;
-  if(color) delete[] color; color = new RGBA8[w*h];
-  if(depth) delete[] depth; depth = new float[w*h];
+  release();
+  allocate(w, h);
 }
 
 int Framebuffer::width() const  { return w; }
@@ -43,7 +78,15 @@ void Framebuffer::setColorBuffer(int i, int j, RGBA8 c)
 void Framebuffer::setDepthBuffer(int i, int j, float d)
 {
   //TODO: check range of i and j
+  float old = depth[i*w+j];
   depth[i*w+j] = d;
+
+  // keep the tile maximum conservative. If we overwrote the
+  // pixel holding the maximum with something smaller, the
+  // maximum may have decreased: recompute it lazily.
+  int tile = (i/HIZ_TILE)*hiz_w + j/HIZ_TILE;
+  if(d >= hiz_max[tile]) hiz_max[tile] = d;
+  else if(old >= hiz_max[tile]) hiz_dirty[tile] = 1;
 }
 
 float Framebuffer::getDepthBuffer(int i, int j) const
@@ -52,9 +95,75 @@ float Framebuffer::getDepthBuffer(int i, int j) const
   return depth[i*w+j];
 }
 
+float Framebuffer::tileMaxDepth(int ti, int tj)
+{
+  int tile = ti*hiz_w + tj;
+  if(hiz_dirty[tile])
+  {
+    int i1 = std::min(h, (ti+1)*HIZ_TILE), j1 = std::min(w, (tj+1)*HIZ_TILE);
+
+    float max_d = -FLT_MAX;
+    for(int i = ti*HIZ_TILE; i < i1; ++i)
+      for(int j = tj*HIZ_TILE; j < j1; ++j)
+        max_d = std::max(max_d, depth[i*w+j]);
+
+    hiz_max[tile] = max_d;
+    hiz_dirty[tile] = 0;
+  }
+
+  return hiz_max[tile];
+}
+
+bool Framebuffer::occluded(int i0, int j0, int i1, int j1, float min_z,
+                            bool pass_equal)
+{
+  for(int ti = i0/HIZ_TILE; ti <= i1/HIZ_TILE; ++ti)
+    for(int tj = j0/HIZ_TILE; tj <= j1/HIZ_TILE; ++tj)
+    {
+      float max_z = tileMaxDepth(ti, tj);
+      if(min_z < max_z || (pass_equal && min_z == max_z)) return false;
+    }
+
+  return true;
+}
+
 void Framebuffer::clearColorBuffer() { memset((void*)color, 0, sizeof(RGBA8)*w*h); }
-void Framebuffer::clearDepthBuffer()
+void Framebuffer::clearDepthBuffer(float value)
 {
   for(int i = 0; i < w*h; ++i)
-    depth[i] = 100.0f;
+    depth[i] = value;
+
+  for(int i = 0; i < hiz_w*hiz_h; ++i)
+  {
+    hiz_max[i] = value;
+    hiz_dirty[i] = 0;
+  }
+}
+
+void Framebuffer::resizeGBuffer(int elem_sz)
+{
+  if(elem_sz == gbuffer_elem_sz) return;
+
+  gbuffer_elem_sz = elem_sz;
+  delete[] gbuffer;
+  gbuffer = new float[w*h*elem_sz];
+  if(!gbuffer_covered) gbuffer_covered = new unsigned char[w*h];
+  clearGBuffer();
+}
+
+void Framebuffer::clearGBuffer()
+{
+  if(gbuffer_covered) memset((void*)gbuffer_covered, 0, w*h);
+}
+
+float* Framebuffer::gBufferWrite(int i, int j)
+{
+  gbuffer_covered[i*w+j] = 1;
+  return &gbuffer[(i*w+j)*gbuffer_elem_sz];
+}
+
+const float* Framebuffer::gBufferRead(int i, int j) const
+{
+  if(!gbuffer_covered[i*w+j]) return nullptr;
+  return &gbuffer[(i*w+j)*gbuffer_elem_sz];
 }
@@ -1,28 +1,49 @@
 #include "../../include/pipeline/pipeline.h"
+#include "../../include/pipeline/pipelinestages.h"
+#include <algorithm>
+
+// in-class constants still need a definition when they
+// are bound to references, as in std::min(VERTEX_BATCH, n)
+const int GraphicPipeline::TILE_SIZE;
+const int GraphicPipeline::FRAGMENT_BATCH;
+const int GraphicPipeline::VERTEX_BATCH;
+const int GraphicPipeline::VERTEX_CHUNK;
+const int GraphicPipeline::TRIANGLE_CHUNK;
 
 // -----------------------------------------
 // -------------- Public API ---------------
 // -----------------------------------------
 GraphicPipeline::GraphicPipeline()
   : vbuffer_in(nullptr),
-    vbuffer(nullptr),
     vertex_size(0),
+    ibuffer_in(nullptr),
+    vbuffer(nullptr),
+    vertex_stream(VERTEX_STREAM_AOS),
+    ibuffer(nullptr),
+    uniform_clock(0),
     vshader(nullptr),
-    fshader(nullptr)
+    fshader(nullptr),
+    tiled(false),
+    raster_algorithm(RASTER_SCANLINE),
+    deferred(false),
+    gbuffer_pass(false),
+    depth_func(DEPTH_LESS),
+    depth_write(true),
+    n_shaded(0),
+    profiling(false),
+    vcodes(nullptr)
 {
+  times = StageTimes();
+
   // preallocate some texture units
   tex_units.resize(10);
 
-  // preallocate uniform memory
-  uniform_data = new float[100];
-  uniform_data_index = 0;
+  // preallocate uniform memory (it grows if needed)
+  uniform_data.reserve(100);
 }
 
 GraphicPipeline::~GraphicPipeline()
 {
-  if(vbuffer_in) delete[] vbuffer_in;
-  if(vbuffer) delete[] vbuffer;
-  delete[] uniform_data;
 }
 
 void GraphicPipeline::set_fragment_shader(FragmentShader& fshader)
@@ -34,14 +55,18 @@ void GraphicPipeline::set_fragment_shader(FragmentShader& fshader)
   fshader.attribs = &attribs;
   fshader.tex_units = &tex_units;
   fshader.uniforms = &uniforms;
-  fshader.uniform_data = (const float*)uniform_data;
+  fshader.uniform_data = uniform_data.data();
+  fshader.uniform_versions = &uniform_versions;
+  fshader.resolve_slots();
   this->fshader = &fshader;
 }
 void GraphicPipeline::set_vertex_shader(VertexShader& vshader)
 {
   vshader.attribs = &attribs;
   vshader.uniforms = &uniforms;
-  vshader.uniform_data = (const float*)uniform_data;
+  vshader.uniform_data = uniform_data.data();
+  vshader.uniform_versions = &uniform_versions;
+  vshader.resolve_slots();
   this->vshader = &vshader;
 }
 
@@ -52,21 +77,55 @@ void GraphicPipeline::bind_tex_unit(const Texture& tex, int unit)
 
 void GraphicPipeline::upload_data(const std::vector<float>& data, int vertex_size)
 {
-  int n_floats = data.size();
+  upload_data(data, vertex_size, std::vector<int>());
+}
+
+void GraphicPipeline::upload_data(const std::vector<float>& data, int vertex_size,
+                                  const std::vector<int>& indices)
+{
+  std::shared_ptr<VertexBuffer> buffer(new VertexBuffer);
+  buffer->data = data;
+  buffer->vertex_size = vertex_size;
+  buffer->indices = indices;
+
+  upload_data(buffer);
+}
+
+void GraphicPipeline::upload_data(const VertexBufferRef& buffer)
+{
+  const std::vector<int>& indices = buffer->indices;
+  upload_data(buffer->data.data(), (int)buffer->data.size(), buffer->vertex_size,
+              indices.empty() ? nullptr : indices.data(), (int)indices.size());
+
+  // keep it alive while we're using it
+  input = buffer;
+}
+
+void GraphicPipeline::upload_data(const float* data, int n_floats, int vertex_size,
+                                  const int* indices, int n_indices)
+{
   this->vertex_size = vertex_size;
   this->n_vertices = (int)(n_floats / vertex_size);
   this->vbuffer_in_sz = n_floats;
+  this->vbuffer_in = data;
+  input.reset();
 
-  // delete any previous allocated data
-  if(vbuffer_in) delete[] vbuffer_in;
+  // a triangle soup: every 3 consecutive vertices make up
+  // a triangle, so this is the trivial index buffer
+  if(!indices)
+  {
+    soup_indices.resize(n_vertices);
+    for(int i = 0; i < n_vertices; ++i) soup_indices[i] = i;
+
+    indices = soup_indices.data();
+    n_indices = n_vertices;
+  }
 
-  // copy data into internal vertex buffer
-  // TODO: as vbuffer_in doesn't change, we could simply store the pointer
-  // instead of copying it (until we need to actually implement this in GPU)
-  vbuffer_in = new float[n_floats];
-  memcpy((void*)vbuffer_in, (const void*)data.data(), n_floats * sizeof(float));
+  this->ibuffer_in = indices;
+  this->ibuffer_in_sz = n_indices;
 
-  // allocate memory for the working vertex buffer.
+  // size of the elements of the working vertex buffer, which
+  // is allocated every frame from the arena (as ibuffer).
   // We need extra space because of the extra w parameter
   // we'll need for perpective interpolation AND the vertex
   // position (akin to GL_POSITION).
@@ -76,14 +135,13 @@ void GraphicPipeline::upload_data(const std::vector<float>& data, int vertex_siz
   // (for example, when rendering 2D things the user will most
   // likely pass a 2D vector with screen coordinates and set
   // the output of the vertex shader to z = 0, for example).
+  // This is a post-transform cache: there is one element per
+  // input vertex (not per triangle corner), so vertices shared
+  // by many triangles are shaded only once.
   this->vbuffer_elem_sz = 4 + vertex_size + 1;
-  this->tri_sz = 3*vbuffer_elem_sz;
-  this->vbuffer_sz = n_vertices * vbuffer_elem_sz;
-
-  vbuffer = new float[vbuffer_sz];
 }
 
-void GraphicPipeline::define_attribute(const std::string& name, int n_floats, int stride)
+int GraphicPipeline::define_attribute(const std::string& name, int n_floats, int stride)
 {
   Attribute a;
   a.size = n_floats;
@@ -92,496 +150,490 @@ void GraphicPipeline::define_attribute(const std::string& name, int n_floats, in
   // remember that vertex and fragment shaders
   // store a pointer to attribs, so we don't need
   // to update them
-  attribs[name] = a;
+  int slot = attribs.slot(name);
+  attribs[slot] = a;
+  return slot;
 }
 
-void GraphicPipeline::upload_uniform(const std::string& name,
-                                      const float* data, int n_floats)
+int GraphicPipeline::attribute_slot(const std::string& name)
 {
-  //copy data
-  memcpy(&uniform_data[uniform_data_index], data, n_floats*sizeof(float));
+  return attribs.slot(name);
+}
 
-  //define attribute address
-  Attribute a;
+int GraphicPipeline::uniform_slot(const std::string& name)
+{
+  return uniforms.slot(name);
+}
+
+void GraphicPipeline::upload_uniform(int slot, const float* data, int n_floats)
+{
+  Attribute& a = uniforms[slot];
+  if((int)uniform_versions.size() <= slot) uniform_versions.resize(slot+1, 0);
+
+  // first upload (or the uniform got bigger): give
+  // it a new place in the end of uniform_data
+  if(a.size < n_floats)
+  {
+    a.stride = (int)uniform_data.size();
+    uniform_data.resize(a.stride + n_floats);
+  }
+  else if(a.size == n_floats &&
+          !memcmp(&uniform_data[a.stride], data, n_floats*sizeof(float)))
+    return;
+
+  //copy data
   a.size = n_floats;
-  a.stride = uniform_data_index;
-  uniforms[name] = a;
+  memcpy(&uniform_data[a.stride], data, n_floats*sizeof(float));
+  uniform_versions[slot] = ++uniform_clock;
+}
 
-  uniform_data_index += n_floats;
+int GraphicPipeline::upload_uniform(const std::string& name,
+                                      const float* data, int n_floats)
+{
+  int slot = uniforms.slot(name);
+  upload_uniform(slot, data, n_floats);
+  return slot;
 }
 
-void GraphicPipeline::upload_uniform(const std::string& name, float d)
+int GraphicPipeline::upload_uniform(const std::string& name, float d)
 {
-  uniform_data[uniform_data_index] = d;
+  int slot = uniforms.slot(name);
+  upload_uniform(slot, &d, 1);
+  return slot;
+}
 
-  Attribute a;
-  a.size = 1;
-  a.stride = uniform_data_index;
-  uniforms[name] = a;
+void GraphicPipeline::set_threads(int n_threads)
+{
+  pool.resize(n_threads);
+}
 
-  uniform_data_index++;
+void GraphicPipeline::set_tiled_rasterization(bool enable, int n_threads)
+{
+  tiled = enable;
+  if(enable) pool.resize(n_threads);
 }
 
-void GraphicPipeline::set_viewport(const mat4& viewport)
+void GraphicPipeline::set_rasterizer(RasterAlgorithm algorithm)
 {
-  this->viewport = viewport;
+  raster_algorithm = algorithm;
 }
 
-void GraphicPipeline::render(Framebuffer& render_target, bool zbuffer,
-                              bool culling, bool cull_back, bool fill)
+void GraphicPipeline::set_vertex_stream(VertexStream layout)
+{
+  vertex_stream = layout;
+}
+
+void GraphicPipeline::set_deferred_shading(bool enable)
+{
+  deferred = enable;
+}
+
+int GraphicPipeline::shaded_fragments() const
+{
+  return n_shaded;
+}
+
+void GraphicPipeline::set_depth_func(DepthFunc func)
 {
-  // reset vbuffer state variables, so loops controlled
-  // by vbuffer_sz will be correct!
-  vbuffer_sz = n_vertices * vbuffer_elem_sz;
+  depth_func = func;
+}
 
-  //NOTE: In OpenGL architecture, culling happens in the primitive
-  //assembly stage, which is the first part of rasterization
+void GraphicPipeline::set_depth_write(bool enable)
+{
+  depth_write = enable;
+}
 
-  // OpenGL demands us to reupload uniforms every loop,
-  // so we imitate this behaviour here. We could define a flag
-  // not to override the previously uploaded uniforms, but this
-  // is very likely to be useless.
-  uniform_data_index = 0;
+float GraphicPipeline::depth_clear_value() const
+{
+  return depth_func == DEPTH_GREATER || depth_func == DEPTH_GEQUAL ? -1.0f : 1.0f;
+}
 
-  vertex_processing();
-  vbuffer_sz = primitive_clipping();
-  perspective_division();
-  if(culling) vbuffer_sz = primitive_culling(cull_back);
-  rasterization(render_target, zbuffer, fill);
+void GraphicPipeline::set_profiling(bool enable)
+{
+  profiling = enable;
 }
 
-// ---------------------------------------
-// -------------- Utilities --------------
-// ---------------------------------------
-static inline void sub_vertex(const float* lhs, const float* rhs,
-                              float* target, int vertex_sz)
+StageTimes GraphicPipeline::stage_times() const
 {
-  for(int i = 0; i < vertex_sz; ++i)
-    target[i] = lhs[i] - rhs[i];
+  return times;
 }
 
-static inline void scalar_vertex(const float* lhs, float k,
-                                  float* target, int vertex_sz)
+ArenaStats GraphicPipeline::scratch_stats() const
 {
-  for(int i = 0; i < vertex_sz; ++i)
-    target[i] = lhs[i] * k;
+  return arena.stats();
 }
 
-static inline void inc_vertex(float* target, float* inc, int vertex_sz)
+void GraphicPipeline::set_viewport(const mat4& viewport)
 {
-  for(int i = 0; i < vertex_sz; ++i)
-    target[i] += inc[i];
+  this->viewport = viewport;
+}
+
+void GraphicPipeline::render(Framebuffer& render_target, bool zbuffer,
+                              bool culling, bool cull_back, bool fill,
+                              PipelineStats* stats)
+{
+  run_pipeline<VirtualShading>(render_target, zbuffer, culling, cull_back,
+                                fill, stats);
 }
 
 // -------------------------------------------
 // -------------- Fixed stages ---------------
 // -------------------------------------------
-void GraphicPipeline::vertex_processing()
-{
-  // TODO: instead of managing indices, use iterating pointers!
-  // vertex processing stage. v stores the starting address of a new
-  // vertex in vbuffer_in and v_id the actual "id" of this very same vertex
-  for(int v = 0, vbuffer_elem = 0;
-      v < vbuffer_in_sz;
-      v += vertex_size, vbuffer_elem += vbuffer_elem_sz)
-  {
-    // input data to vertex shader (akin to the "in"
-    // variables in GLSL) is the raw vbuffer_in
-    const float* vertex_data = &vbuffer_in[v];
-
-    // output data (akin to the "out" variables in GLSL)
-    // are the elements in the vbuffer from the 5th position
-    // on, because the first 4 floats are dedicated to the
-    // vertex position and will be aliased as the OUT_POS
-    // variable. The attribute "1" in the end must remain
-    // untouched.
-    vec4 out_pos;
-    float* target = &vbuffer[vbuffer_elem+4];
-
-    vshader->launch(vertex_data, target, vertex_size, out_pos);
-
-    // setup elements Position and 1.0 in vbuffer
-    for(int i = 0; i < 4; ++i) vbuffer[vbuffer_elem+i] = out_pos(i);
-    vbuffer[vbuffer_elem + vbuffer_elem_sz-1] = 1.0f;
-  }
-
-  return;
+// whether triangle v0v1v2 (after perspective division) is culled
+static inline bool is_culled(const float* v0, const float* v1, const float* v2,
+                              bool cull_back)
+{
+  vec3 v0_(v0[0], v0[1], 1.0f);
+  vec3 v1_(v1[0], v1[1], 1.0f);
+  vec3 v2_(v2[0], v2[1], 1.0f);
+
+  //compute cross product p = v0v1 X v0v2;
+  //if p is pointing outside the screen, v0v1v2 are defined
+  //in counter-clockwise order. then, reject or accept this
+  //triangle based on the param.front_face flag.
+  vec3 c = (v1_-v0_).cross(v2_-v0_);
+
+  // cull clockwise triangles (z component of vector
+  // product c is facing -z)
+  return !( (cull_back && c(2) >= 0) ||
+            (!cull_back && c(2) <= 0) );
 }
 
-int GraphicPipeline::primitive_clipping()
+unsigned int GraphicPipeline::cull_mask(const int* tris, int count,
+                                        bool cull_back) const
 {
-  int non_clipped = 0;
-  for(int t = 0; t < vbuffer_sz; t += tri_sz)
+  unsigned int culled = 0;
+
+#if defined(__AVX2__)
+  // the same cross product as is_culled(), for 8 triangles
+  // at once, gathering their vertices from the x/y planes
+  if(vertex_stream == VERTEX_STREAM_SOA && count == 8)
   {
-    bool discard = false;
+    const __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const float *xs = vbuffer, *ys = &vbuffer[vbuffer_stride];
 
-    // a primitive is discarded if any of
-    // its vertices is not visible
-    for(int v_id = 0; v_id < 3; ++v_id)
+    __m256 x[3], y[3];
+    for(int k = 0; k < 3; ++k)
     {
-      float* v = &vbuffer[t + v_id*vbuffer_elem_sz];
-      float w = v[3];
+      __m256i ids = _mm256_i32gather_epi32(&tris[k], offsets, 4);
+      x[k] = _mm256_i32gather_ps(xs, ids, 4);
+      y[k] = _mm256_i32gather_ps(ys, ids, 4);
+    }
 
-      // discard primitives behind the camera
-      if( w <= 0 )
-      {
-        discard = true;
-        break;
-      }
+    __m256 c = _mm256_sub_ps(
+                _mm256_mul_ps(_mm256_sub_ps(x[1], x[0]), _mm256_sub_ps(y[2], y[0])),
+                _mm256_mul_ps(_mm256_sub_ps(y[1], y[0]), _mm256_sub_ps(x[2], x[0])));
 
-      // clip primitives outside frustum
-      if(std::fabs(v[0]) > w || std::fabs(v[1]) > w || std::fabs(v[2]) > w)
-      {
-        discard = true;
-        break;
-      }
+    __m256 kept = cull_back ? _mm256_cmp_ps(c, _mm256_setzero_ps(), _CMP_GE_OQ)
+                            : _mm256_cmp_ps(c, _mm256_setzero_ps(), _CMP_LE_OQ);
+    return ~(unsigned int)_mm256_movemask_ps(kept) & 0xFF;
+  }
+#endif
+
+  for(int i = 0; i < count; ++i)
+  {
+    const int *tri = &tris[3*i];
+    if(vertex_stream == VERTEX_STREAM_AOS)
+    {
+      const int elem_sz = vbuffer_elem_sz;
+      if(is_culled(&vbuffer[tri[0]*elem_sz], &vbuffer[tri[1]*elem_sz],
+                    &vbuffer[tri[2]*elem_sz], cull_back))
+        culled |= 1 << i;
+      continue;
     }
 
-    // if this primitive has survived clipping, copy it to
-    // the vertex buffer...
-    // ...but well, things are a bit more complicated. We could
-    // have different vertex buffers and make copying simpler,
-    // but for this first, single-threaded version, we just send
-    // surviving primitives to the beginning of vbuffer, e.g.,
-    // suppose we have:
-    //
-    // vbuffer: [ V0 V1 V2 V3 V4 ... Vn ]
-    // vbuffer_sz: n
-    //
-    // and we found that V0, V1 and V4 survived the clipping while
-    // V2, V3, V5, V6, ... Vn did not; so we copy V4 to the beginning
-    // of the vector and change its size:
-    //
-    // vbuffer: [ V0 V1 V4 V3 V4 ... Vn ]
-    // vbuffer_sz: 3
-    //
-    // A GPU implementation of this would need a new buffer (or
-    // intermediate per-block cache) to handle this without needing
-    // lots of sync barriers.
-    if(!discard)
+    float v[3][2];
+    for(int k = 0; k < 3; ++k)
     {
-      // TODO: checking whether non_clipped == 0 may spare some
-      // memoves (but not many)
-      float *target = &vbuffer[non_clipped];
-      memmove(target, &vbuffer[t], tri_sz*sizeof(float));
-      non_clipped += tri_sz;
+      v[k][0] = vertex_component(tri[k], 0);
+      v[k][1] = vertex_component(tri[k], 1);
     }
+
+    if(is_culled(v[0], v[1], v[2], cull_back)) culled |= 1 << i;
   }
 
-  return non_clipped;
+  return culled;
 }
 
-void GraphicPipeline::perspective_division()
+void GraphicPipeline::clip_triangle(const int* tri, int planes,
+                                    bool culling, bool cull_back,
+                                    RasterState& state, ClipChunk& out)
 {
-  // loop over each element (each vertex) inside
-  // the vertex buffer, dividing it by w (which
-  // we know to be the fourth element of the array).
-  for(int v_id = 0; v_id < vbuffer_sz; v_id += vbuffer_elem_sz)
+  const int elem_sz = vbuffer_elem_sz;
+  float *scratch = state.clip;
+
+  // Sutherland-Hodgman: clip the polygon against each plane in
+  // turn. Polygon vertices are slots of the scratch buffer: the
+  // first 3 are the triangle vertices, back in clip space (they
+  // were divided by w in vertex_processing, unless outside some
+  // plane), and new ones are created after them. Every plane adds
+  // at most one vertex to the polygon and creates at most two.
+  for(int k = 0; k < 3; ++k)
   {
-    float *v = &vbuffer[v_id];
-    float w = v[3];
-
-    for(int i = 0; i < vbuffer_elem_sz; ++i)
-      v[i] /= w;
+    float *target = &scratch[k*elem_sz];
+    float w = vcodes[tri[k]] ? 1.0f : 1.0f / vertex_component(tri[k], elem_sz-1);
+    for(int i = 0; i < elem_sz; ++i) target[i] = vertex_component(tri[k], i) * w;
   }
 
-  return;
-}
-
-int GraphicPipeline::primitive_culling(bool cull_back)
-{
-  // loop over each primitive, check whether
-  // it is frontfacing or backfacing and then
-  // if it should be culled
-  int non_culled = 0;
-  for(int t = 0; t < vbuffer_sz; t += tri_sz)
+  int poly[3 + N_CLIP_PLANES] = {0, 1, 2}, clipped[3 + N_CLIP_PLANES];
+  int n = 3, n_slots = 3;
+  for(int p = 0; p < N_CLIP_PLANES && n > 0; ++p)
   {
-    float *v0 = &vbuffer[t + 0*vbuffer_elem_sz];
-    float *v1 = &vbuffer[t + 1*vbuffer_elem_sz];
-    float *v2 = &vbuffer[t + 2*vbuffer_elem_sz];
-
-    vec3 v0_(v0[0], v0[1], 1.0f);
-    vec3 v1_(v1[0], v1[1], 1.0f);
-    vec3 v2_(v2[0], v2[1], 1.0f);
-
-    //compute cross product p = v0v1 X v0v2;
-    //if p is pointing outside the screen, v0v1v2 are defined
-    //in counter-clockwise order. then, reject or accept this
-    //triangle based on the param.front_face flag.
-    vec3 c = (v1_-v0_).cross(v2_-v0_);
-
-    // cull clockwise triangles (z component of vector product
-    // c is facing -z). We do the same in place update of the
-    // vertex buffer as we did in the primitive clipping step
-    if( (cull_back && c(2) >= 0) ||
-        (!cull_back && c(2) <= 0) )
+    if( !(planes & (1 << p)) ) continue;
+
+    int n_out = 0;
+    for(int i = 0; i < n; ++i)
     {
-      float* target = &vbuffer[non_culled];
-      memmove(target, &vbuffer[t], tri_sz*sizeof(float));
-      non_culled += tri_sz;
+      int a = poly[i], b = poly[(i+1) % n];
+      float da = plane_distance(&scratch[a*elem_sz], p);
+      float db = plane_distance(&scratch[b*elem_sz], p);
+
+      if(da >= 0.0f) clipped[n_out++] = a;
+      if((da >= 0.0f) == (db >= 0.0f)) continue;
+
+      // edge crosses the plane. Always interpolate from the inner
+      // vertex, so an edge shared by two triangles is split at the
+      // very same point and we don't get cracks. Attributes vary
+      // linearly in clip space, so we interpolate the whole element.
+      int in = da >= 0.0f ? a : b, ex = da >= 0.0f ? b : a;
+      float d_in = da >= 0.0f ? da : db, d_ex = da >= 0.0f ? db : da;
+      float t = d_in / (d_in - d_ex);
+
+      const float *v_in = &scratch[in*elem_sz];
+      const float *v_ex = &scratch[ex*elem_sz];
+      float *target = &scratch[n_slots*elem_sz];
+      for(int j = 0; j < elem_sz; ++j)
+        target[j] = v_in[j] + (v_ex[j] - v_in[j]) * t;
+
+      clipped[n_out++] = n_slots++;
     }
-  }
-
-  return non_culled;
-}
-
-void GraphicPipeline::rasterization(Framebuffer& render_target, bool zbuffer,
-                                    bool fill)
-{
-  // akin to an assembly move. This will (should) be used for
-  // buffers of the same size only, so we don't need the size
-  // as parameter.
-  #define MOVE(s,t) { memcpy(t, s, vbuffer_elem_sz*sizeof(float)); }
-  #define ROUND(x) ((int)(x + 0.5f))
-  #define SWAP(a,b) { float* aux = b; b = a; a = aux; }
-  #define X(x) (x[0])
-  #define Y(x) (x[1])
-  #define Z(x) (x[2])
-  #define W(x) (x[3])
 
-  // preallocate buffers
-  // QUESTION: Those work more or less like _registers_,
-  // we just use them as operand holders for the rasterization
-  // operation as neither their size nor their location changes
-  // throughout the whole computation, except for the moment where
-  // upload data to the GPU; how is it implemented in video cards?
-  // TODO: Once this is working, allocate a single contiguous
-  // vector and make pointers point to sections of it; this should
-  // increase cache locality.
-  float *v0 = new float[vbuffer_elem_sz];
-  float *v1 = new float[vbuffer_elem_sz];
-  float *v2 = new float[vbuffer_elem_sz];
-
-  float* dV0_dy = new float[vbuffer_elem_sz];
-  float* dV1_dy = new float[vbuffer_elem_sz];
-  float* dV2_dy = new float[vbuffer_elem_sz];
-
-  float *start = new float[vbuffer_elem_sz];  //starting fragment in scanline
-  float *end = new float[vbuffer_elem_sz];    //ending fragment in scanline
-  float *dV_dx = new float[vbuffer_elem_sz];  //horizontal increment
-  float *f = new float[vbuffer_elem_sz];      //bilinearly interpolated fragment
-  float *frag = new float[vbuffer_elem_sz];   //persective interpolated fragment
-  float *dVdx_w = new float[vbuffer_elem_sz]; //persective interpolated derivatives
-
-  for(int t = 0; t < vbuffer_sz; t += tri_sz)
+    memcpy(poly, clipped, n_out*sizeof(int));
+    n = n_out;
+  }
+  if(n < 3) return;
+
+  // vertices which survived clipping are inside every plane,
+  // so they are already divided in vbuffer. New vertices are
+  // divided and stored in the chunk, with negative indices
+  // (-1 for the first one, -2 for the second...) until they are
+  // moved to vbuffer.
+  int ids[3 + N_CLIP_PLANES];
+  for(int i = 0; i < n; ++i)
   {
-    float *v0_ = &vbuffer[t + 0*vbuffer_elem_sz];
-    float *v1_ = &vbuffer[t + 1*vbuffer_elem_sz];
-    float *v2_ = &vbuffer[t + 2*vbuffer_elem_sz];
-
-    //we need x and y positions mapped to the viewport and
-    //with integer coordinates, otherwise we'll have displacements
-    //for start and end which are huge when 0 < dy < 1;
-    //these cases must be treated as straight, horizontal lines.
-    //TODO: THIS IS CORRECT BUT CODE IS SHITTY
-    vec4 pos0 = viewport*vec4(v0_[0], v0_[1], 1.0f, 1.0f);
-    X(v0) = ROUND(pos0(0)); Y(v0) = ROUND(pos0(1));
-    Z(v0) = v0_[2]; W(v0) = v0_[vbuffer_elem_sz-1];
-    memcpy(&v0[4], &v0_[4], (vbuffer_elem_sz-4)*sizeof(float));
-
-    vec4 pos1 = viewport*vec4(v1_[0], v1_[1], 1.0f, 1.0f);
-    X(v1) = ROUND(pos1(0)); Y(v1) = ROUND(pos1(1));
-    Z(v1) = v1_[2]; W(v1) = v1_[vbuffer_elem_sz-1];
-    memcpy(&v1[4], &v1_[4], (vbuffer_elem_sz-4)*sizeof(float));
-
-    vec4 pos2 = viewport*vec4(v2_[0], v2_[1], 1.0f, 1.0f);
-    X(v2) = ROUND(pos2(0)); Y(v2) = ROUND(pos2(1));
-    Z(v2) = v2_[2]; W(v2) = v2_[vbuffer_elem_sz-1];
-    memcpy(&v2[4], &v2_[4], (vbuffer_elem_sz-4)*sizeof(float));
-
-    //order vertices by y coordinate
-    if( Y(v0) > Y(v1) ) SWAP(v0, v1);
-    if( Y(v0) > Y(v2) ) SWAP(v0, v2);
-    if( Y(v1) > Y(v2) ) SWAP(v1, v2);
-
-    //these dVdy_ variables define how much we must
-    //increment v when increasing one unit in y, so
-    //we can use this to compute the start and end
-    //boundaries for rasterization. Notice that not
-    //only this defines the actual x coordinate of the
-    //fragment in the scanline, but all the other
-    //attributes. Also, notice that y is integer and
-    //thus if we make dy0 = (v1.y-v0.y) steps in y, for intance,
-    //incrementing v0 with dVdy0 at each step, by the end of
-    //the dy steps we'll have:
-    //
-    // v0 + dy0 * dVdy0 = v0 + dy0*(v1-v0)/dy0 = v0 + v1 - v0 = v1
-    //
-    //which is exactly what we want, a linear interpolation
-    //between v0 and v1 with dy0 steps
-    //TODO: Preallocate dVx_dy in the upload_data() routine!
-    sub_vertex(v1, v0, dV0_dy, vbuffer_elem_sz);
-    scalar_vertex(dV0_dy, 1.0f/(Y(v1)-Y(v0)), dV0_dy, vbuffer_elem_sz);
-
-    sub_vertex(v2, v0, dV1_dy, vbuffer_elem_sz);
-    scalar_vertex(dV1_dy, 1.0f/(Y(v2)-Y(v0)), dV1_dy, vbuffer_elem_sz);
-
-    sub_vertex(v2, v1, dV2_dy, vbuffer_elem_sz);
-    scalar_vertex(dV2_dy, 1.0f/(Y(v2)-Y(v1)), dV2_dy, vbuffer_elem_sz);
-
-    // these pointers store the current increment for starting
-    // ending segments
-    float *dStart_dy, *dEnd_dy;
-
-    //this will tell us whether we should change dStart_dy
-    //or dEnd_dy to the next active edge (dV2_dy) when we
-    //reach halfway the triangle
-    float **next_active_edge;
-
-    //decide start/end edges. If v1 is to the left
-    //side of the edge connecting v0 and v2, then v0v1
-    //is the starting edge and v0v2 is the ending edge;
-    //if v1 is to the right, it is the contrary.
-    //the v0v1 edge will be substituted by the v1v2 edge
-    //when we reach the v1 vertex while scanlining, so we
-    //store which of the start/end edges we should replace
-    //with v1v2.
-    vec3 right_side = vec3(X(v1)-X(v0), Y(v1)-Y(v0), 0.0f).cross(vec3(X(v2)-X(v0), Y(v2)-Y(v0), 0.0f));
-    if( right_side(2) > 0.0f )
-    {
-      dEnd_dy = dV0_dy;
-      dStart_dy = dV1_dy;
-      next_active_edge = &dEnd_dy;
-    }
-    else
+    if(poly[i] < 3)
     {
-      dEnd_dy = dV1_dy;
-      dStart_dy = dV0_dy;
-      next_active_edge = &dStart_dy;
+      ids[i] = tri[poly[i]];
+      continue;
     }
 
-    //handle flat top triangles
-    if( Y(v0) == Y(v1) )
+    const float *v = &scratch[poly[i]*elem_sz];
+    float w = v[3];
+    ids[i] = -(int)(out.verts.size() / elem_sz) - 1;
+    for(int j = 0; j < elem_sz; ++j) out.verts.push_back(v[j] / w);
+  }
+
+  // triangulate the resulting (convex) polygon as a fan
+  for(int i = 1; i < n-1; ++i)
+  {
+    int fan[3] = {ids[0], ids[i], ids[i+1]};
+
+    if(culling)
     {
-      //switch active edge and update
-      //starting and ending points
-      if( X(v0) < X(v1) )
+      float v[3][2];
+      for(int k = 0; k < 3; ++k)
       {
-        dEnd_dy = dV2_dy;
-        //start = v0; end = v1;
-        MOVE(v0, start);
-        MOVE(v1, end);
+        if(fan[k] < 0)
+          memcpy(v[k], &out.verts[(-fan[k]-1)*elem_sz], 2*sizeof(float));
+        else
+        {
+          v[k][0] = vertex_component(fan[k], 0);
+          v[k][1] = vertex_component(fan[k], 1);
+        }
       }
-      else
+      if(is_culled(v[0], v[1], v[2], cull_back))
       {
-        dStart_dy = dV2_dy;
-        //start = v1; end = v0;
-        MOVE(v1, start);
-        MOVE(v0, end);
+        PIPELINE_STAT(state.stats.triangles_culled, 1);
+        continue;
       }
     }
-    else
-    {
-      //start = end = v0;
-      MOVE(v0, start);
-      MOVE(v0, end);
-    }
 
-    //loop over scanlines
-    for(int y = Y(v0); y <= Y(v2); ++y)
+    out.tris.insert(out.tris.end(), fan, fan+3);
+  }
+}
+
+int GraphicPipeline::primitive_assembly(bool culling, bool cull_back)
+{
+  // primitive assembly happens here: triangles are read from
+  // the input index buffer and their vertices fetched from the
+  // post-transform cache (vbuffer). This stage clips and culls
+  // them in parallel, in chunks of TRIANGLE_CHUNK triangles.
+  const int elem_sz = vbuffer_elem_sz;
+  int n_tris = ibuffer_in_sz / 3;
+  int n_chunks = (n_tris + TRIANGLE_CHUNK-1) / TRIANGLE_CHUNK;
+  clip_chunks.resize(n_chunks);
+
+  double pass_start = profiling ? clock_seconds() : 0.0;
+  pool.run(n_chunks, [&](int chunk, int thread_id)
+  {
+    double start = profiling ? clock_seconds() : 0.0;
+    ClipChunk& out = clip_chunks[chunk];
+    RasterState& state = raster_state[thread_id];
+    out.tris.clear();
+    out.verts.clear();
+
+    // triangles are culled 8 at a time
+    int last = std::min((chunk+1) * TRIANGLE_CHUNK, n_tris);
+    for(int first = chunk * TRIANGLE_CHUNK; first < last; first += 8)
     {
-      //starting and ending points for scanline rasterization
-      //TODO: this is causing the rasterization to try to update
-      //invalid positions on the color/depth buffer and then
-      //segfaults as of the deletion procedures. Check this!
-      // -> interesting; updating invalid positions on the color
-      // buffer probably messes up with the beginning of the
-      // next array
-      int s = ROUND(X(start)), e = ROUND(X(end));
-
-      // compute horizontal increment dV_dx
-      sub_vertex(end, start, dV_dx, vbuffer_elem_sz);
-      scalar_vertex(dV_dx, 1.0f/(e-s), dV_dx, vbuffer_elem_sz);
-
-      // initialize the actual fragment
-      MOVE(start, f);
-
-      for(int x = s; x <= e; ++x)
+      int count = std::min(8, last - first);
+      unsigned int culled = culling ? cull_mask(&ibuffer_in[3*first], count,
+                                                cull_back) : 0;
+
+      for(int i = 0; i < count; ++i)
       {
-        //in order to draw only the edges, we skip this
-        //the scanline rasterization in all points but
-        //the extremities.
-        if(!fill && (x != s && x != e)) continue;
-
-        // To better represent what the pipeline does, we should, in the
-        // following order:
-        //
-        // 1) perform early fragment tests at this point (which include
-        // depth buffering, scissor testing and stencil buffering, for
-        // for example), which decide whether this fragment will live
-        // or not. Notice that at this point, a fragment is the set of
-        // attributes interpolated by the rasterizer;
-        //
-        // 2) evaluate fragment shader to compute a pixel sample from the
-        // fragment's attributes;
-        //
-        // 3) perform per-sample operations like alpha
-        // blending using the sample computed in the previous stage;
-        //
-        // It is interesting to notice that, as of version 4.6, the OpenGL
-        // specification calls "per-fragment
-        // operations" both early fragment tests (which MAY be performed
-        // before or after fragment shader evaluation, but executing before
-        // allows us to discard fragments without evaluating them) and
-        // per-sample operations (like like alpha blending, dithering and
-        // sRGB conversions), which MUST be performed after fragment shader
-        // evaluation because we need a pixel sample.
-
-        // Here we mixed things in the same code for simplicity.
-        // Execute fragment operations if zbuffer is disabled or
-        // it is enabled and fragment is closer then the one stored
-        // in z-buffer.
-        if( !zbuffer || Z(f) < render_target.getDepthBuffer(y,x) ) // early fragment tests
+        const int *tri = &ibuffer_in[3*(first + i)];
+        int c0 = vcodes[tri[0]], c1 = vcodes[tri[1]], c2 = vcodes[tri[2]];
+
+        // all vertices outside the same plane: discard
+        if(c0 & c1 & c2)
+        {
+          PIPELINE_STAT(state.stats.triangles_culled, 1);
+          continue;
+        }
+
+        // polygon clipping is only needed when some vertex
+        // is outside the guard band (or the near/far planes)
+        if(c0 | c1 | c2)
         {
-          // TODO: this need not to performed if zbuffer is disabled,
-          // saving lots of memory accesses
-          render_target.setDepthBuffer(y, x, Z(f));
-
-          // perspectively-correct interpolation of attributes
-          // and derivatives
-          scalar_vertex(f, 1.0f/W(f), frag, vbuffer_elem_sz);
-          scalar_vertex(dV_dx, 1.0f/W(f), dVdx_w, vbuffer_elem_sz);
-
-          // invoke fragment shader for the interpolated fragment
-          rgba frag_color = fshader->launch(frag, dVdx_w, vbuffer_elem_sz);
-
-          // write to framebuffer
-          RGBA8 color_ubyte;
-          color_ubyte.r = std::min(255, (int)(frag_color(0)*255.0f));
-          color_ubyte.g = std::min(255, (int)(frag_color(1)*255.0f));
-          color_ubyte.b = std::min(255, (int)(frag_color(2)*255.0f));
-          color_ubyte.a = std::min(255, (int)(frag_color(3)*255.0f));
-
-          render_target.setColorBuffer(y, x, color_ubyte);
+          PIPELINE_STAT(state.stats.triangles_clipped, 1);
+          double clip_start = profiling ? clock_seconds() : 0.0;
+
+          clip_triangle(tri, c0 | c1 | c2, culling, cull_back,
+                        state, out);
+
+          if(profiling) state.sub_time += clock_seconds() - clip_start;
+          continue;
+        }
+
+        if(culled & (1 << i))
+        {
+          PIPELINE_STAT(state.stats.triangles_culled, 1);
+          continue;
         }
 
-        inc_vertex(f, dV_dx, vbuffer_elem_sz);
+        // Vertices stay where they are, so we
+        // just copy 3 ints per triangle.
+        out.tris.insert(out.tris.end(), tri, tri+3);
       }
+    }
+
+    if(profiling) state.busy_time += clock_seconds() - start;
+  });
+
+  // the compaction below is accounted as culling
+  if(profiling) times.clip = sub_stage_time(clock_seconds() - pass_start);
+
+  // order preserving compaction: chunk outputs are concatenated
+  // in chunk order, so the triangle order is always the same no
+  // matter how many threads we have. New vertices go after the
+  // n_vertices transformed by vertex_processing.
+  int n_indices = 0, n_total = n_vertices;
+  for(auto c = clip_chunks.begin(); c != clip_chunks.end(); ++c)
+  {
+    c->tri_offset = n_indices;
+    c->vert_offset = n_total;
+    n_indices += (int)c->tris.size();
+    n_total += (int)c->verts.size() / elem_sz;
+  }
+
+  // vbuffer is the last allocation from the arena,
+  // so it usually grows in place
+  bool soa = vertex_stream == VERTEX_STREAM_SOA;
+  if(!soa)
+  {
+    vbuffer = arena.grow(vbuffer, vbuffer_sz, n_total*elem_sz);
+    vbuffer_sz = n_total*elem_sz;
+  }
+  else if(n_total > vbuffer_stride)
+  {
+    // planes must be moved apart
+    int stride = (n_total + 7) / 8 * 8;
+    vbuffer = arena.grow(vbuffer, vbuffer_sz, stride*elem_sz);
+    for(int i = elem_sz-1; i > 0; --i)
+      memmove(&vbuffer[i*stride], &vbuffer[i*vbuffer_stride],
+              n_vertices*sizeof(float));
+
+    vbuffer_stride = stride;
+    vbuffer_sz = stride*elem_sz;
+  }
+  ibuffer = arena.allocate<int>(n_indices);
+
+  pool.run(n_chunks, [&](int chunk, int /*thread_id*/)
+  {
+    const ClipChunk& c = clip_chunks[chunk];
 
-      //switch active edges if halfway through the triangle
-      //This MUST be done before incrementing, otherwise
-      //once we reached v1 we would pass through it and
-      //start coming back only in the next step, causing
-      //the big "leaking" triangles!
-      if( y == (int)Y(v1) ) *next_active_edge = dV2_dy;
+    int *target = &ibuffer[c.tri_offset];
+    for(int i = 0; i < (int)c.tris.size(); ++i)
+      target[i] = c.tris[i] >= 0 ? c.tris[i] : c.vert_offset - c.tris[i] - 1;
 
-      //increment bounds
-      inc_vertex(start, dStart_dy, vbuffer_elem_sz);
-      inc_vertex(end, dEnd_dy, vbuffer_elem_sz);
+    if(c.verts.empty()) return;
+
+    if(!soa)
+    {
+      memcpy(&vbuffer[c.vert_offset*elem_sz], c.verts.data(),
+              c.verts.size()*sizeof(float));
+      return;
     }
+
+    int n = (int)c.verts.size() / elem_sz;
+    for(int i = 0; i < elem_sz; ++i)
+    {
+      float *plane = &vbuffer[i*vbuffer_stride + c.vert_offset];
+      for(int e = 0; e < n; ++e) plane[e] = c.verts[e*elem_sz + i];
+    }
+  });
+
+  return n_indices;
+}
+
+void GraphicPipeline::setup_raster_state()
+{
+  // preallocate buffers
+  // QUESTION: Those work more or less like _registers_,
+  // we just use them as operand holders for the rasterization
+  // operation as neither their size nor their location changes
+  // throughout the whole computation, except for the moment where
+  // upload data to the GPU; how is it implemented in video cards?
+  // Each thread needs its own set. Arena allocations are aligned
+  // to cache lines, so threads don't share any of them.
+  raster_state.resize(pool.size());
+  for(auto st = raster_state.begin(); st != raster_state.end(); ++st)
+  {
+    st->regs = arena.allocate<float>(N_RASTER_REGS * vbuffer_elem_sz);
+    st->frags = arena.allocate<float>(FRAGMENT_BATCH * vbuffer_elem_sz);
+    st->dVdx = arena.allocate<float>(FRAGMENT_BATCH * vbuffer_elem_sz);
+    st->frag_x = arena.allocate<int>(FRAGMENT_BATCH);
+    st->frag_y = arena.allocate<int>(FRAGMENT_BATCH);
+    st->colors = arena.allocate<rgba>(FRAGMENT_BATCH);
+    st->clip = arena.allocate<float>((3 + 2*N_CLIP_PLANES) * vbuffer_elem_sz);
+    st->vertices = arena.allocate<float>(VERTEX_BATCH * vbuffer_elem_sz);
+    st->n_frags = 0;
+    st->shaded = 0;
+    st->busy_time = st->sub_time = 0.0;
+    st->stats = PipelineStats();
+  }
+}
+
+double GraphicPipeline::sub_stage_time(double wall)
+{
+  double busy = 0.0, sub = 0.0;
+  for(auto st = raster_state.begin(); st != raster_state.end(); ++st)
+  {
+    busy += st->busy_time;
+    sub += st->sub_time;
+    st->busy_time = st->sub_time = 0.0;
   }
 
-  // clean buffers
-  delete[] v0;
-  delete[] v1;
-  delete[] v2;
-  delete[] dV0_dy;
-  delete[] dV1_dy;
-  delete[] dV2_dy;
-  delete[] start;
-  delete[] end;
-  delete[] f;
-  delete[] frag;
-  delete[] dV_dx;
-  delete[] dVdx_w;
+  return busy > 0.0 ? wall * std::min(1.0, sub / busy) : 0.0;
 }
@@ -0,0 +1,108 @@
+#include "../../include/pipeline/threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool()
+  : job(nullptr), n_tasks(0), next_task(0),
+    busy_workers(0), generation(0), quit(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+  stop_workers();
+}
+
+void ThreadPool::stop_workers()
+{
+  {
+    std::unique_lock<std::mutex> l(lock);
+    quit = true;
+  }
+  job_ready.notify_all();
+
+  for(auto w = workers.begin(); w != workers.end(); ++w)
+    w->join();
+
+  workers.clear();
+  quit = false;
+}
+
+void ThreadPool::resize(int n_threads)
+{
+  if(n_threads <= 0)
+    n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+  if(n_threads == size()) return;
+
+  // workers are cheap to recreate and this is
+  // not supposed to be called every frame
+  stop_workers();
+
+  // new workers must not take the last job for a new one
+  unsigned int current;
+  {
+    std::unique_lock<std::mutex> l(lock);
+    current = generation;
+  }
+
+  for(int i = 1; i < n_threads; ++i)
+    workers.push_back( std::thread(&ThreadPool::worker_loop, this, i, current) );
+}
+
+int ThreadPool::size() const
+{
+  return (int)workers.size() + 1;
+}
+
+void ThreadPool::work(int thread_id)
+{
+  for(int t = next_task++; t < n_tasks; t = next_task++)
+    (*job)(t, thread_id);
+}
+
+void ThreadPool::worker_loop(int thread_id, unsigned int seen)
+{
+  while(true)
+  {
+    {
+      std::unique_lock<std::mutex> l(lock);
+      job_ready.wait(l, [&]{ return quit || generation != seen; });
+      if(quit) return;
+      seen = generation;
+    }
+
+    work(thread_id);
+
+    {
+      std::unique_lock<std::mutex> l(lock);
+      if(--busy_workers == 0) job_done.notify_one();
+    }
+  }
+}
+
+void ThreadPool::run(int n_tasks, const std::function<void(int,int)>& job)
+{
+  // no workers: don't bother with synchronization
+  if(workers.empty())
+  {
+    for(int t = 0; t < n_tasks; ++t) job(t, 0);
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> l(lock);
+    this->job = &job;
+    this->n_tasks = n_tasks;
+    this->next_task = 0;
+    this->busy_workers = (int)workers.size();
+    this->generation++;
+  }
+  job_ready.notify_all();
+
+  // the calling thread works too
+  work(0);
+
+  std::unique_lock<std::mutex> l(lock);
+  job_done.wait(l, [&]{ return busy_workers == 0; });
+  this->job = nullptr;
+}
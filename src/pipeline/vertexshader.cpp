@@ -1,15 +1,49 @@
 #include "../../include/pipeline/vertexshader.h"
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+
+void VertexShader::resolve_slots()
+{
+  view_id = uniform_slot("view");
+  proj_id = uniform_slot("proj");
+  model_id = uniform_slot("model");
+  pos_id = attribute_slot("pos");
+  normal_id = attribute_slot("normal");
+}
+
+void VertexShader::prepare()
+{
+  // shaders that don't use the standard uniforms: there's
+  // nothing uploaded to read the matrices from
+  if(uniform_version(model_id) == 0 ||
+     uniform_version(view_id) == 0 ||
+     uniform_version(proj_id) == 0)
+    return;
+
+  unsigned int version = std::max(uniform_version(model_id),
+                          std::max(uniform_version(view_id),
+                                   uniform_version(proj_id)));
+
+  // nothing changed since the last render() call
+  if(prepared_for == uniform_versions && prepared_version == version)
+    return;
+
+  mat4 view( get_uniform(view_id) );
+  mat4 proj( get_uniform(proj_id) );
+  model = mat4( get_uniform(model_id) );
+
+  view_proj = proj * view;
+  normal_matrix = model.inverse().transpose();
+
+  prepared_for = uniform_versions;
+  prepared_version = version;
+}
 
 void VertexShader::launch(const float* vertex_in, float* vertex_out,
                           int vertex_sz, vec4& position)
 {
-  mat4 view( get_uniform("view") );
-  mat4 proj( get_uniform("proj") );
-  mat4 model( get_uniform("model") );
-
-  vec3 pos_( get_attribute("pos", vertex_in) );
+  vec3 pos_( get_attribute(pos_id, vertex_in) );
 
   vec4 pos = model * vec4(pos_, 1.0f);
 
@@ -20,11 +54,23 @@ void VertexShader::launch(const float* vertex_in, float* vertex_out,
 
   //forward untransformed normals
   //TODO: THIS IS WRONG!!!
-  int n_s = (*attribs)["normal"].stride;
+  int n_s = (*attribs)[normal_id].stride;
   memcpy(&vertex_out[n_s], &vertex_in[n_s], 3*sizeof(float));
 
   //return projected vertex
-  pos = proj * view * pos;
+  pos = view_proj * pos;
   for(int i = 0; i < 4; ++i)
     position(i) = pos(i);
 }
+
+void VertexShader::launch_batch(const float* vertex_in, float* vertex_out,
+                                int count, int in_stride, int out_stride)
+{
+  for(int i = 0; i < count; ++i)
+  {
+    vec4 pos;
+    float *out = &vertex_out[i*out_stride];
+    launch(&vertex_in[i*in_stride], &out[4], in_stride, pos);
+    for(int j = 0; j < 4; ++j) out[j] = pos(j);
+  }
+}
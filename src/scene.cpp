@@ -0,0 +1,136 @@
+#include "../include/scene.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+// the stb implementation lives in the pipeline library, so
+// front ends only need to include the header
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../3rdparty/stb_image_write.h"
+
+VertexBufferRef mesh_vertex_buffer(const Mesh& mesh)
+{
+  // It's a bit dumb to copy each element in a for loop
+  // using push_back(), but this is just because our meshes
+  // have only position information (in the general case,
+  // at least texture coordinates would be present and we
+  // would need to store them inside mesh_data also).
+  std::shared_ptr<VertexBuffer> mesh_data(new VertexBuffer);
+  mesh_data->vertex_size = 6;
+  mesh_data->indices = mesh.indices;
+  for(int i = 0; i < mesh.pos.size(); i += 3)
+  {
+    mesh_data->data.push_back(mesh.pos[i+0]);
+    mesh_data->data.push_back(mesh.pos[i+1]);
+    mesh_data->data.push_back(mesh.pos[i+2]);
+    mesh_data->data.push_back(mesh.normal[i+0]);
+    mesh_data->data.push_back(mesh.normal[i+1]);
+    mesh_data->data.push_back(mesh.normal[i+2]);
+  }
+
+  return mesh_data;
+}
+
+// renders one of the voxelization views
+static void voxelize_view(VoxelizerPipeline& gp, Framebuffer& target,
+                          const mat4& model, const mat4& view, const mat4& proj,
+                          const char* debug_prefix, const char* name)
+{
+  // rendered without z-buffer, so the
+  // depth buffer is never touched
+  target.clearColorBuffer();
+  gp.set_viewport(mat4::viewport(target.width(), target.height()));
+
+  gp.upload_uniform("view", view.data(), 16);
+  gp.upload_uniform("model", model.data(), 16);
+  gp.upload_uniform("proj", proj.data(), 16);
+
+  gp.render(target, false, false);
+
+  if(!debug_prefix) return;
+
+  std::string path = std::string(debug_prefix) + name + ".png";
+  stbi_write_png(path.c_str(), target.width(), target.height(),
+                  4, (const void*)target.colorBuffer(),
+                  sizeof(RGBA8)*target.width());
+}
+
+void build_octree(VoxelizerPipeline& gp, Framebuffer& target,
+                  const Mesh& mesh, const mat4& model,
+                  const char* debug_prefix)
+{
+  // compute scene bounding box
+  vec3 bb_min(FLT_MAX,FLT_MAX,FLT_MAX), bb_max(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+  for(int t = 0; t < mesh.pos.size(); t += 3)
+  {
+    vec4 p = model * vec4(mesh.pos[t+0],
+                          mesh.pos[t+1],
+                          mesh.pos[t+2],
+                          1.0f);
+
+    for(int j = 0; j < 3; ++j)
+    {
+      bb_min(j) = std::fmin(bb_min(j), p(j));
+      bb_max(j) = std::fmax(bb_max(j), p(j));
+    }
+  }
+
+  printf("Bounding box: \n");
+  printf("\t(%f, %f, %f) - (%f, %f, %f)\n", bb_min(0), bb_min(1), bb_min(2),
+                                            bb_max(0), bb_max(1), bb_max(2));
+
+  // compute minimal CUBIC bounding box which will be used
+  // to define the rasterization limits
+  vec3 diff = bb_max - bb_min;
+  int greatest_axis = 0;
+
+  for(int i = 0; i < 3; ++i)
+    if(diff(i) > diff(greatest_axis))
+      greatest_axis = i;
+
+  // side of the cubic bounding box
+  float l = diff(greatest_axis);
+
+  vec3 cubic_bb_min = bb_min;
+  vec3 cubic_bb_max = bb_min + vec3(l,l,l);
+
+  OctreeBuilderShader::tree.set_aabb(cubic_bb_min, cubic_bb_max);
+
+  printf("Cubic bounding box: \n");
+  printf("\t(%f, %f, %f) - (%f, %f, %f)\n", bb_min(0), bb_min(1), bb_min(2),
+                                            cubic_bb_max(0),
+                                            cubic_bb_max(1),
+                                            cubic_bb_max(2));
+
+  // setup common matrices
+  float half_l = l * 0.5f;
+  mat4 proj = mat4::orthogonal(-half_l, half_l, -half_l, half_l, 0.0f, l + 0.5f);
+
+  //XY view
+  vec3 eye = cubic_bb_min;
+  eye(0) = cubic_bb_min(0) + half_l;
+  eye(1) = cubic_bb_min(1) + half_l;
+  eye(2) = cubic_bb_min(2);
+  mat4 view = mat4::view(eye, eye + vec3(0.0f, 0.0f, +1.0f), vec3(0.0f, 1.0f, 0.0f));
+  voxelize_view(gp, target, model, view, proj, debug_prefix, "XY");
+
+  //XZ view
+  eye = cubic_bb_min;
+  eye(0) = cubic_bb_min(0) + half_l;
+  eye(1) = cubic_bb_min(1);
+  eye(2) = cubic_bb_min(2) + half_l;
+  view = mat4::view(eye, eye + vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 0.0f, +1.0f));
+  voxelize_view(gp, target, model, view, proj, debug_prefix, "XZ");
+
+  //YZ view
+  eye = cubic_bb_min;
+  eye(0) = cubic_bb_min(0);
+  eye(1) = cubic_bb_min(1) + half_l;
+  eye(2) = cubic_bb_min(2) + half_l;
+  view = mat4::view(eye, eye + vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+  voxelize_view(gp, target, model, view, proj, debug_prefix, "YZ");
+
+  // rays traverse the compact version of the tree
+  OctreeBuilderShader::tree.compact();
+}